@@ -11,6 +11,8 @@ class DemoProtocol : public Protocol
 public:
     DemoProtocol()
     {
+        set_handler( PING, boost::bind( &DemoProtocol::handle_ping, this, _1, _2 ) );
+        set_handler( PONG, boost::bind( &DemoProtocol::handle_pong, this, _1, _2 ) );
     }
     
     virtual ~DemoProtocol()
@@ -38,25 +40,22 @@ public:
         std::cout << "Connection terminated!" << std::endl;
     }
 
-    /// we received a msg from this connection
+    void handle_ping( message_ptr msgp, connection_ptr conn )
+    {
+        std::cout << "Got a ping, replying with a pong." << std::endl;
+        conn->async_write( message_ptr(new PongMessage( m_router->gen_uuid() )) );
+    }
+    
+    void handle_pong( message_ptr msgp, connection_ptr conn )
+    {
+        std::cout << "Got a pong, yay!" << std::endl;
+    }
+
+    /// we received a msg of a type with no handler
     virtual void message_received( message_ptr msgp, connection_ptr conn )
     {
-        std::cout << "DemoProtocol::message_received " 
-                  << conn->str() << std::endl 
-                  << msgp->str() << std::endl;
-        switch( msgp->type() )
-        {
-            case PING:
-                std::cout << "Got a ping, replying with a pong." << std::endl;
-                conn->async_write( message_ptr(new PongMessage( m_router->gen_uuid() )) );
-                break;
-            case PONG:
-                std::cout << "Got a pong, yay!" << std::endl;
-                break;
-            default:
-                std::cout << "Unhandled message type: " 
-                          << msgp->type() << std::endl;
-        }
+        std::cout << "Unhandled message type: " 
+                  << (int)msgp->type() << " from " << conn->str() << std::endl;
     }
 
 };
@@ -5,6 +5,7 @@
 #include <boost/asio.hpp>
 #include <boost/thread/thread.hpp>
 #include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
 
 #include "libf2f/router.h"
 #include "libf2f/protocol.h"
@@ -36,9 +37,9 @@ lame_uuid_gen()
 
 int main(int argc, char **argv)
 {
-    if( argc != 2 )
+    if( argc != 2 && argc != 3 )
     {
-        cout <<"Usage: " << argv[0] << " <port>" << endl;
+        cout <<"Usage: " << argv[0] << " <port> [io_threads]" << endl;
         return 1;
     }
     
@@ -54,7 +55,12 @@ int main(int argc, char **argv)
                             port)
             ) 
     );
-    Router r(accp, &p, boost::bind(&lame_uuid_gen));
+    unsigned int io_threads = argc == 3 ? atoi(argv[2]) : 0;
+    Router r(accp, &p, boost::bind(&lame_uuid_gen), io_threads);
+    // liveness checks shouldn't queue behind bulk data:
+    r.set_type_priority( PING, Connection::PRIO_HIGH );
+    r.set_type_priority( PONG, Connection::PRIO_HIGH );
+    r.set_capabilities( Connection::CAP_WIRE_V2 );
     
     boost::thread t( boost::bind(&iorun, &ios) );
     
@@ -86,6 +92,21 @@ int main(int argc, char **argv)
             message_ptr ping = message_ptr(new PingMessage( r.gen_uuid() ));
             r.send_all(ping);
         }
+        if(parts[0] == "stats")
+        {
+            router_metrics rm = r.get_metrics();
+            cout << "accepted " << rm.accepted << " connected " << rm.connected
+                 << " connections " << rm.connections << endl;
+            BOOST_FOREACH( const connection_ptr& c, *r.connections() )
+            {
+                connection_metrics cm = c->get_metrics();
+                cout << c->str() << " in " << cm.msgs_in << "/" << cm.bytes_in
+                     << " out " << cm.msgs_out << "/" << cm.bytes_out
+                     << " queued " << cm.writeq_msgs
+                     << " write p99 " << cm.write_latency.percentile( 0.99 )
+                     << "us rtt " << cm.rtt_us << "us" << endl;
+            }
+        }
         /*
         if(parts[0] == "query" && parts.size() == 2)
         {
@@ -0,0 +1,147 @@
+#include "bench.h"
+
+#include "libf2f/router.h"
+#include "libf2f/protocol.h"
+#include "libf2f/connection.h"
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <algorithm>
+#include <iostream>
+
+namespace bench {
+
+using namespace std;
+using namespace libf2f;
+
+namespace {
+
+string
+uuid_gen()
+{
+    return string( 36, '0' );
+}
+
+/// counts admissions
+class Counter : public Protocol
+{
+public:
+    Counter() : m_admitted( 0 ) {}
+    
+    virtual bool new_incoming_connection( connection_ptr )
+    {
+        m_admitted.fetch_add( 1, boost::memory_order_relaxed );
+        return true;
+    }
+    
+    boost::atomic<size_t> m_admitted;
+};
+
+/// Connects n sockets to ep one after another, each connect's latency
+/// in us goes in lat. The sockets stay open until the end of the run.
+void
+storm( boost::asio::io_service * ios, boost::asio::ip::tcp::endpoint ep,
+       size_t n, vector<double> * lat,
+       vector< boost::shared_ptr<boost::asio::ip::tcp::socket> > * socks )
+{
+    for( size_t i = 0; i < n; ++i )
+    {
+        boost::shared_ptr<boost::asio::ip::tcp::socket> s(
+                                new boost::asio::ip::tcp::socket( *ios ) );
+        const double t = now();
+        boost::system::error_code ec;
+        s->connect( ep, ec );
+        if( ec ) continue;
+        lat->push_back( ( now() - t ) * 1e6 );
+        socks->push_back( s );
+    }
+}
+
+double
+percentile( vector<double>& v, double q )
+{
+    if( v.empty() ) return 0;
+    size_t i = size_t( q * v.size() );
+    if( i >= v.size() ) i = v.size() - 1;
+    nth_element( v.begin(), v.begin() + i, v.end() );
+    return v[i];
+}
+
+} // anon ns
+
+/// Reconnect storm: --clients threads connect --conns sockets as fast as
+/// they can. With --listeners=1 the Router accepts through listen()'s
+/// SO_REUSEPORT acceptors, one per io thread, otherwise through its one
+/// acceptor.
+int
+run_accept( const Options& opts )
+{
+    const size_t conns     = opts.get<size_t>( "conns", 5000 );
+    const size_t clients   = opts.get<size_t>( "clients", 8 );
+    const unsigned int io  = opts.get<unsigned int>( "io", 4 );
+    const bool listeners   = opts.get<int>( "listeners", 1 ) != 0;
+    const unsigned int pending = opts.get<unsigned int>( "pending",
+                            unsigned( Router::default_pending_accepts ) );
+    if( !conns || !clients )
+    {
+        cerr << "bad --conns or --clients" << endl;
+        return 1;
+    }
+    
+    using namespace boost::asio::ip;
+    boost::asio::io_service ios;
+    boost::asio::io_service::work work( ios );
+    Counter proto;
+    boost::shared_ptr<tcp::acceptor> acc(
+        new tcp::acceptor( ios, tcp::endpoint( address_v4::loopback(), 0 ) ) );
+    Router r( acc, &proto, &uuid_gen, io );
+    tcp::endpoint ep( address_v4::loopback(), acc->local_endpoint().port() );
+    if( listeners ) ep = r.listen( tcp::endpoint( address_v4::loopback(), 0 ),
+                                   pending );
+    boost::thread acceptor_thread( boost::bind( &boost::asio::io_service::run,
+                                                &ios ) );
+    
+    // blocking connects only, nobody needs to run it:
+    boost::asio::io_service client_ios;
+    vector< vector<double> > lats( clients );
+    vector< vector< boost::shared_ptr<tcp::socket> > > socks( clients );
+    const double start = now();
+    boost::thread_group threads;
+    for( size_t i = 0; i < clients; ++i )
+    {
+        const size_t n = conns / clients + ( i < conns % clients ? 1 : 0 );
+        threads.create_thread( boost::bind( &storm, &client_ios, ep, n, &lats[i],
+                                            &socks[i] ) );
+    }
+    threads.join_all();
+    // connect() returns once the handshake is done, accepting comes later:
+    while( proto.m_admitted.load() < conns && now() - start < 60 )
+        boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+    const double secs = now() - start;
+    const size_t admitted = proto.m_admitted.load();
+    
+    vector<double> lat;
+    for( size_t i = 0; i < clients; ++i )
+        lat.insert( lat.end(), lats[i].begin(), lats[i].end() );
+    socks.clear();
+    r.stop();
+    ios.stop();
+    acceptor_thread.join();
+    
+    Result( "accept" )
+        .add( "conns", conns )
+        .add( "clients", clients )
+        .add( "io_threads", io )
+        .add( "listeners", listeners )
+        .add( "pending", listeners ? pending : 1 )
+        .add( "accepted", admitted )
+        .add( "accepts_per_sec", admitted / secs )
+        .add( "connect_p50_us", percentile( lat, 0.5 ) )
+        .add( "connect_p99_us", percentile( lat, 0.99 ) )
+        .add( "connect_max_us", percentile( lat, 1.0 ) )
+        .print();
+    return 0;
+}
+
+} //ns
@@ -0,0 +1,119 @@
+#include "bench.h"
+
+#include "libf2f/router.h"
+#include "libf2f/protocol.h"
+#include "libf2f/connection.h"
+#include "libf2f/pool.h"
+
+#include <boost/bind.hpp>
+
+namespace bench {
+
+using namespace std;
+using namespace libf2f;
+
+namespace {
+
+const string fixed_uuid( 36, '0' );
+
+string
+uuid_gen()
+{
+    return fixed_uuid;
+}
+
+/// Sends windows of messages from one router to the other, all on the
+/// io thread, and samples allocation counters between warmup and the end.
+class AllocProtocol : public Protocol
+{
+public:
+    AllocProtocol( boost::asio::io_service& ios, size_t total, size_t warmup,
+                   size_t window, size_t size )
+        : m_ios( ios ), m_total( total ), m_warmup( warmup ), 
+          m_window( window ), m_body( size, 'x' ),
+          m_sent( 0 ), m_rcvd( 0 )
+    {}
+    
+    virtual void new_outgoing_connection( connection_ptr conn )
+    {
+        m_conn = conn;
+        m_ios.post( boost::bind( &AllocProtocol::send_window, this ) );
+    }
+    
+    virtual void message_received( message_ptr msgp, connection_ptr conn )
+    {
+        ++m_rcvd;
+        if( m_rcvd == m_warmup )
+        {
+            m_start_mallocs = malloc_count();
+            m_start_pool = get_pool_stats();
+            m_start_time = now();
+        }
+        if( m_rcvd == m_total )
+        {
+            m_end_mallocs = malloc_count();
+            m_end_pool = get_pool_stats();
+            m_end_time = now();
+            m_ios.stop();
+            return;
+        }
+        if( m_rcvd == m_sent ) send_window();
+    }
+    
+    void send_window()
+    {
+        for( size_t i = 0; i < m_window && m_sent < m_total; ++i, ++m_sent )
+        {
+            m_conn->async_write( message_ptr( 
+                                    new GeneralMessage( 3, m_body, fixed_uuid ) ) );
+        }
+    }
+    
+    boost::asio::io_service& m_ios;
+    size_t m_total, m_warmup, m_window;
+    string m_body;
+    size_t m_sent, m_rcvd;
+    connection_ptr m_conn;
+    
+    boost::uint64_t m_start_mallocs, m_end_mallocs;
+    pool_stats m_start_pool, m_end_pool;
+    double m_start_time, m_end_time;
+};
+
+} // anon ns
+
+int
+run_alloc( const Options& opts )
+{
+    const size_t msgs   = opts.get<size_t>( "msgs", 200000 );
+    const size_t warmup = opts.get<size_t>( "warmup", 20000 );
+    const size_t window = opts.get<size_t>( "window", 64 );
+    const size_t size   = opts.get<size_t>( "size", 64 );
+    
+    using namespace boost::asio::ip;
+    boost::asio::io_service ios;
+    boost::shared_ptr<tcp::acceptor> a1( 
+        new tcp::acceptor( ios, tcp::endpoint( address_v4::loopback(), 0 ) ) );
+    boost::shared_ptr<tcp::acceptor> a2( 
+        new tcp::acceptor( ios, tcp::endpoint( address_v4::loopback(), 0 ) ) );
+    AllocProtocol p( ios, warmup + msgs, warmup, window, size );
+    Router r1( a1, &p, &uuid_gen );
+    Router r2( a2, &p, &uuid_gen );
+    tcp::endpoint ep( address_v4::loopback(), a1->local_endpoint().port() );
+    r2.connect_to_remote( ep );
+    ios.run();
+    
+    const double secs = p.m_end_time - p.m_start_time;
+    Result( "alloc" )
+        .add( "size", size )
+        .add( "msgs", msgs )
+        .add( "msgs_per_sec", msgs / secs )
+        .add( "mallocs_per_msg", 
+              double( p.m_end_mallocs - p.m_start_mallocs ) / msgs )
+        .add( "pool_misses_per_msg", 
+              double( p.m_end_pool.system_allocs - p.m_start_pool.system_allocs ) / msgs )
+        .print();
+    return 0;
+}
+
+} //ns
@@ -0,0 +1,67 @@
+#ifndef __F2F_BENCH_H__
+#define __F2F_BENCH_H__
+
+#include <boost/cstdint.hpp>
+#include <boost/lexical_cast.hpp>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace bench {
+
+/// number of calls to malloc made by this process so far.
+/// only counted with glibc, always 0 elsewhere.
+boost::uint64_t malloc_count();
+
+/// monotonic wall clock, in seconds
+double now();
+
+/// user+system cpu time used by the process, in seconds
+double cpu_time();
+
+/// --key=value command line options
+class Options
+{
+public:
+    Options( const std::vector<std::string>& args );
+    
+    template <typename T>
+    T get( const std::string& key, const T& def ) const
+    {
+        std::map<std::string,std::string>::const_iterator it = m_opts.find(key);
+        if( it == m_opts.end() ) return def;
+        return boost::lexical_cast<T>( it->second );
+    }
+    
+private:
+    std::map<std::string,std::string> m_opts;
+};
+
+/// One result, printed as a single line of JSON so runs can be tracked
+class Result
+{
+public:
+    Result( const std::string& bench );
+    
+    Result& add( const std::string& key, double val );
+    Result& add( const std::string& key, const std::string& val );
+    
+    /// writes the JSON line to stdout
+    void print() const;
+    
+private:
+    std::ostringstream m_os;
+};
+
+/// workloads, each returns a process exit code:
+int run_alloc( const Options& opts );
+int run_registry( const Options& opts );
+int run_pingpong( const Options& opts );
+int run_fanout( const Options& opts );
+int run_fanin( const Options& opts );
+int run_accept( const Options& opts );
+
+} //ns
+
+#endif
@@ -0,0 +1,310 @@
+#include "bench.h"
+
+#include "libf2f/router.h"
+#include "libf2f/protocol.h"
+#include "libf2f/connection.h"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace bench {
+
+using namespace std;
+using namespace libf2f;
+
+namespace {
+
+const string fixed_uuid( 36, '0' );
+
+string
+uuid_gen()
+{
+    return fixed_uuid;
+}
+
+enum pattern
+{
+    PINGPONG,   // one client, the hub echoes each msg back
+    FANOUT,     // the hub send_all()s to every peer
+    FANIN       // every peer sends to the hub
+};
+
+class Loopback;
+
+/// One end of the benchmark, forwards to Loopback
+class Side : public Protocol
+{
+public:
+    Side( Loopback& lb, bool hub ) : m_lb( lb ), m_hub( hub ) {}
+    
+    virtual bool new_incoming_connection( connection_ptr conn );
+    virtual void new_outgoing_connection( connection_ptr conn );
+    virtual void message_received( message_ptr msgp, connection_ptr conn );
+
+private:
+    Loopback& m_lb;
+    bool m_hub;
+};
+
+/// Runs windows of messages over loopback, everything on one io thread.
+/// Each payload starts with the time it was sent, the receiver records
+/// the latency (round trip for pingpong) of every delivery after warmup.
+class Loopback
+{
+public:
+    Loopback( boost::asio::io_service& ios, pattern pat, size_t peers,
+              size_t total, size_t warmup, size_t window,
+              const vector<size_t>& sizes )
+        : m_ios( ios ), m_pattern( pat ), m_peers( peers ),
+          m_total( total ), m_warmup( warmup ), m_window( window ),
+          m_sizes( sizes ), m_next_size( 0 ), m_broadcast( false ),
+          m_sent( 0 ), m_rcvd( 0 ), m_bytes( 0 )
+    {
+        for( size_t i = 0; i < sizes.size(); ++i )
+        {
+            if( !m_bodies.count( sizes[i] ) )
+                m_bodies[ sizes[i] ] = string( sizes[i], 'x' );
+        }
+        m_latencies.reserve( total - warmup );
+    }
+    
+    void connected( connection_ptr conn, bool hub )
+    {
+        ( hub ? m_hub_conns : m_peer_conns ).push_back( conn );
+        if( m_hub_conns.size() == m_peers && m_peer_conns.size() == m_peers )
+            m_ios.post( boost::bind( &Loopback::send_window, this ) );
+    }
+    
+    void received( message_ptr msgp, connection_ptr conn, bool hub )
+    {
+        if( m_pattern == PINGPONG && hub )
+        {
+            conn->async_write( msgp );
+            return;
+        }
+        double sent;
+        memcpy( &sent, msgp->payload(), sizeof(sent) );
+        ++m_rcvd;
+        if( m_rcvd > m_warmup )
+        {
+            m_latencies.push_back( now() - sent );
+            m_bytes += msgp->length();
+        }
+        if( m_rcvd == m_warmup ) start_measuring();
+        if( m_rcvd == m_total )
+        {
+            m_end_mallocs = malloc_count();
+            m_end_time = now();
+            m_end_cpu = cpu_time();
+            m_ios.stop();
+            return;
+        }
+        if( m_rcvd == m_sent ) send_window();
+    }
+    
+    void start_measuring()
+    {
+        m_start_mallocs = malloc_count();
+        m_start_time = now();
+        m_start_cpu = cpu_time();
+    }
+    
+    /// a msg from the size distribution, stamped with the current time
+    message_ptr make_msg()
+    {
+        const size_t size = m_sizes[ m_next_size++ % m_sizes.size() ];
+        message_ptr msgp( new GeneralMessage( 3, m_bodies[size], fixed_uuid ) );
+        const double t = now();
+        memcpy( msgp->payload(), &t, sizeof(t) );
+        return msgp;
+    }
+    
+    /// counts deliveries, so fanout sends window/peers msgs to everyone
+    void send_window()
+    {
+        if( m_warmup == 0 && m_sent == 0 ) start_measuring();
+        switch( m_pattern )
+        {
+        case PINGPONG:
+            for( size_t i = 0; i < m_window && m_sent < m_total; ++i, ++m_sent )
+                m_peer_conns[0]->async_write( make_msg() );
+            break;
+        case FANOUT:
+            for( size_t i = 0; i < m_window && m_sent < m_total;
+                 i += m_peers, m_sent += m_peers )
+            {
+                if( m_broadcast ) m_hub_router->broadcast( make_msg() );
+                else m_hub_router->send_all( make_msg() );
+            }
+            break;
+        case FANIN:
+            for( size_t i = 0; i < m_window && m_sent < m_total; )
+            {
+                for( size_t p = 0; p < m_peers; ++p, ++i, ++m_sent )
+                    m_peer_conns[p]->async_write( make_msg() );
+            }
+            break;
+        }
+    }
+    
+    boost::asio::io_service& m_ios;
+    pattern m_pattern;
+    size_t m_peers, m_total, m_warmup, m_window;
+    vector<size_t> m_sizes;
+    map<size_t, string> m_bodies;
+    size_t m_next_size;
+    vector<connection_ptr> m_hub_conns, m_peer_conns;
+    Router * m_hub_router;
+    bool m_broadcast;           // fanout through Router::broadcast
+    
+    size_t m_sent, m_rcvd;
+    boost::uint64_t m_bytes;
+    vector<double> m_latencies;
+    boost::uint64_t m_start_mallocs, m_end_mallocs;
+    double m_start_time, m_end_time, m_start_cpu, m_end_cpu;
+};
+
+bool
+Side::new_incoming_connection( connection_ptr conn )
+{
+    m_lb.connected( conn, m_hub );
+    return true;
+}
+
+void
+Side::new_outgoing_connection( connection_ptr conn )
+{
+    m_lb.connected( conn, m_hub );
+}
+
+void
+Side::message_received( message_ptr msgp, connection_ptr conn )
+{
+    m_lb.received( msgp, conn, m_hub );
+}
+
+/// latency in microseconds at quantile q of the sorted samples
+double
+percentile( const vector<double>& sorted, double q )
+{
+    if( sorted.empty() ) return 0;
+    size_t i = size_t( q * sorted.size() );
+    if( i >= sorted.size() ) i = sorted.size() - 1;
+    return sorted[i] * 1e6;
+}
+
+/// --sizes=64,64,64,4096 picks sizes round robin from the list, so repeat
+/// a size to weight it. Sizes are at least 8, for the timestamp.
+vector<size_t>
+parse_sizes( const string& s )
+{
+    vector<size_t> sizes;
+    size_t pos = 0;
+    while( pos <= s.size() )
+    {
+        size_t comma = s.find( ',', pos );
+        if( comma == string::npos ) comma = s.size();
+        if( comma > pos )
+        {
+            const size_t n = boost::lexical_cast<size_t>(
+                                    s.substr( pos, comma - pos ) );
+            sizes.push_back( std::min( std::max( n, size_t(8) ),
+                                       size_t(max_payload_size) ) );
+        }
+        pos = comma + 1;
+    }
+    return sizes;
+}
+
+int
+run_pattern( const string& name, pattern pat, const Options& opts )
+{
+    const size_t peers  = pat == PINGPONG ? 1 : opts.get<size_t>( "peers", 8 );
+    const size_t msgs   = opts.get<size_t>( "msgs", 200000 );
+    const size_t warmup = opts.get<size_t>( "warmup", 20000 );
+    const size_t window = opts.get<size_t>( "window", pat == PINGPONG ? 1 : 64 );
+    const string sizes_opt = opts.get<string>( "sizes",
+                                opts.get<string>( "size", "64" ) );
+    const vector<size_t> sizes = parse_sizes( sizes_opt );
+    if( sizes.empty() || peers == 0 || window == 0 )
+    {
+        cerr << "bad --sizes, --peers or --window" << endl;
+        return 1;
+    }
+    const string tcp_opt = opts.get<string>( "tcp", "nodelay" );
+    socket_options sockopts;
+    sockopts.sndbuf = opts.get<int>( "sndbuf", 0 );
+    sockopts.rcvbuf = opts.get<int>( "rcvbuf", 0 );
+    if( tcp_opt == "nagle" ) sockopts.mode = socket_options::SEND_NAGLE;
+    else if( tcp_opt == "adaptive" ) sockopts.mode = socket_options::SEND_ADAPTIVE;
+    else if( tcp_opt != "nodelay" )
+    {
+        cerr << "bad --tcp, use nodelay, nagle or adaptive" << endl;
+        return 1;
+    }
+    
+    using namespace boost::asio::ip;
+    boost::asio::io_service ios;
+    Loopback lb( ios, pat, peers, warmup + msgs, warmup, window, sizes );
+    Side hub( lb, true ), peer( lb, false );
+    boost::shared_ptr<tcp::acceptor> ha(
+        new tcp::acceptor( ios, tcp::endpoint( address_v4::loopback(), 0 ) ) );
+    boost::shared_ptr<tcp::acceptor> pa(
+        new tcp::acceptor( ios, tcp::endpoint( address_v4::loopback(), 0 ) ) );
+    Router hr( ha, &hub, &uuid_gen );
+    Router pr( pa, &peer, &uuid_gen );
+    hr.set_socket_options( sockopts );
+    pr.set_socket_options( sockopts );
+    lb.m_hub_router = &hr;
+    lb.m_broadcast = opts.get<int>( "broadcast", 0 ) != 0;
+    tcp::endpoint ep( address_v4::loopback(), ha->local_endpoint().port() );
+    for( size_t i = 0; i < peers; ++i ) pr.connect_to_remote( ep );
+    ios.run();
+    
+    const double secs = lb.m_end_time - lb.m_start_time;
+    const size_t n = lb.m_latencies.size();
+    sort( lb.m_latencies.begin(), lb.m_latencies.end() );
+    Result( name )
+        .add( "sizes", sizes_opt )
+        .add( "peers", peers )
+        .add( "window", window )
+        .add( "broadcast", lb.m_broadcast )
+        .add( "tcp", tcp_opt )
+        .add( "sndbuf", sockopts.sndbuf )
+        .add( "rcvbuf", sockopts.rcvbuf )
+        .add( "msgs", n )
+        .add( "msgs_per_sec", n / secs )
+        .add( "mb_per_sec", lb.m_bytes / secs / ( 1024 * 1024 ) )
+        .add( "p50_us", percentile( lb.m_latencies, 0.5 ) )
+        .add( "p99_us", percentile( lb.m_latencies, 0.99 ) )
+        .add( "p999_us", percentile( lb.m_latencies, 0.999 ) )
+        .add( "cpu_us_per_msg", ( lb.m_end_cpu - lb.m_start_cpu ) * 1e6 / n )
+        .add( "mallocs_per_msg",
+              double( lb.m_end_mallocs - lb.m_start_mallocs ) / n )
+        .print();
+    return 0;
+}
+
+} // anon ns
+
+int
+run_pingpong( const Options& opts )
+{
+    return run_pattern( "pingpong", PINGPONG, opts );
+}
+
+int
+run_fanout( const Options& opts )
+{
+    return run_pattern( "fanout", FANOUT, opts );
+}
+
+int
+run_fanin( const Options& opts )
+{
+    return run_pattern( "fanin", FANIN, opts );
+}
+
+} //ns
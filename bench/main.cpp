@@ -0,0 +1,45 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "bench.h"
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if( argc < 2 )
+    {
+        cout << "Usage: " << argv[0] << " <workload> [--option=value ...]" << endl
+             << "Workloads:" << endl
+             << "  alloc     steady-state allocations per message over loopback" << endl
+             << "            --msgs=N --size=BYTES --warmup=N --window=N" << endl
+             << "  registry  connection register/lookup/unregister cost by size" << endl
+             << "            --min=N --max=N --lookups=N" << endl
+             << "  pingpong  round trip latency, one msg in flight by default" << endl
+             << "            --msgs=N --warmup=N --window=N --sizes=N[,N...]" << endl
+             << "  fanout    one router send_all()s to --peers connections" << endl
+             << "            --peers=N --msgs=N --warmup=N --window=N --sizes=N[,N...]" << endl
+             << "            --broadcast=1 to use Router::broadcast instead" << endl
+             << "  fanin     --peers connections all send to one router" << endl
+             << "            --peers=N --msgs=N --warmup=N --window=N --sizes=N[,N...]" << endl
+             << "            pingpong, fanout and fanin also take" << endl
+             << "            --tcp=nodelay|nagle|adaptive --sndbuf=BYTES --rcvbuf=BYTES" << endl
+             << "  accept    --clients threads connect --conns sockets at once" << endl
+             << "            --conns=N --clients=N --io=N --listeners=0|1 --pending=N" << endl;
+        return 1;
+    }
+    
+    string mode = argv[1];
+    bench::Options opts( vector<string>( argv + 2, argv + argc ) );
+    
+    if( mode == "alloc" ) return bench::run_alloc( opts );
+    if( mode == "registry" ) return bench::run_registry( opts );
+    if( mode == "pingpong" ) return bench::run_pingpong( opts );
+    if( mode == "fanout" ) return bench::run_fanout( opts );
+    if( mode == "fanin" ) return bench::run_fanin( opts );
+    if( mode == "accept" ) return bench::run_accept( opts );
+    
+    cerr << "Unknown workload: " << mode << endl;
+    return 1;
+}
@@ -0,0 +1,104 @@
+#include "bench.h"
+
+#include "libf2f/router.h"
+#include "libf2f/protocol.h"
+#include "libf2f/connection.h"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+
+namespace bench {
+
+using namespace std;
+using namespace libf2f;
+
+namespace {
+
+string
+uuid_gen()
+{
+    return string( 36, '0' );
+}
+
+/// deterministic shuffle, so runs are comparable
+void
+shuffle_order( vector<size_t>& v, boost::uint32_t seed )
+{
+    for( size_t i = v.size(); i > 1; --i )
+    {
+        seed = seed * 1103515245 + 12345;
+        swap( v[i-1], v[ (seed >> 8) % i ] );
+    }
+}
+
+/// registers n named connections, looks them up by name in random order,
+/// then unregisters them in a different random order.
+void
+run_size( Router& r, size_t n, size_t lookups )
+{
+    vector<connection_ptr> conns;
+    conns.reserve( n );
+    for( size_t i = 0; i < n; ++i )
+    {
+        connection_ptr c = r.new_connection();
+        c->set_name( "peer-" + boost::lexical_cast<string>( i ) );
+        conns.push_back( c );
+    }
+    vector<size_t> order( n );
+    for( size_t i = 0; i < n; ++i ) order[i] = i;
+    
+    double t0 = now();
+    for( size_t i = 0; i < n; ++i ) r.register_connection( conns[i] );
+    double t1 = now();
+    
+    shuffle_order( order, 1 );
+    vector<string> names;
+    names.reserve( lookups );
+    for( size_t i = 0; i < lookups; ++i ) 
+        names.push_back( conns[ order[ i % n ] ]->name() );
+    size_t found = 0;
+    double t2 = now();
+    for( size_t i = 0; i < lookups; ++i )
+    {
+        if( r.get_connection_by_name( names[i] ) ) ++found;
+    }
+    double t3 = now();
+    
+    shuffle_order( order, 2 );
+    double t4 = now();
+    for( size_t i = 0; i < n; ++i ) r.unregister_connection( conns[ order[i] ] );
+    double t5 = now();
+    
+    Result( "registry" )
+        .add( "connections", n )
+        .add( "register_ns", (t1 - t0) * 1e9 / n )
+        .add( "lookup_ns", (t3 - t2) * 1e9 / lookups )
+        .add( "unregister_ns", (t5 - t4) * 1e9 / n )
+        .add( "found", found )
+        .print();
+}
+
+} // anon ns
+
+int
+run_registry( const Options& opts )
+{
+    const size_t min     = opts.get<size_t>( "min", 10 );
+    const size_t max     = opts.get<size_t>( "max", 100000 );
+    const size_t lookups = opts.get<size_t>( "lookups", 100000 );
+    
+    using namespace boost::asio::ip;
+    boost::asio::io_service ios;
+    boost::shared_ptr<tcp::acceptor> a( 
+        new tcp::acceptor( ios, tcp::endpoint( address_v4::loopback(), 0 ) ) );
+    Protocol p;
+    // the io_service is never run, connections are only registered:
+    Router r( a, &p, &uuid_gen );
+    for( size_t n = min; n <= max; n *= 10 )
+    {
+        run_size( r, n, lookups );
+    }
+    return 0;
+}
+
+} //ns
@@ -0,0 +1,106 @@
+#include "bench.h"
+
+#include <boost/atomic.hpp>
+#include <cstdio>
+#include <ctime>
+#include <sys/resource.h>
+
+#ifdef __GLIBC__
+// count mallocs by interposing on glibc's allocator
+extern "C" void * __libc_malloc( size_t );
+extern "C" void * __libc_calloc( size_t, size_t );
+extern "C" void * __libc_realloc( void *, size_t );
+
+static boost::atomic<boost::uint64_t> g_mallocs(0);
+
+extern "C" void * malloc( size_t n )
+{
+    g_mallocs.fetch_add( 1, boost::memory_order_relaxed );
+    return __libc_malloc( n );
+}
+
+extern "C" void * calloc( size_t n, size_t sz )
+{
+    g_mallocs.fetch_add( 1, boost::memory_order_relaxed );
+    return __libc_calloc( n, sz );
+}
+
+extern "C" void * realloc( void * p, size_t n )
+{
+    g_mallocs.fetch_add( 1, boost::memory_order_relaxed );
+    return __libc_realloc( p, n );
+}
+#endif
+
+namespace bench {
+
+using namespace std;
+
+boost::uint64_t
+malloc_count()
+{
+#ifdef __GLIBC__
+    return g_mallocs.load( boost::memory_order_relaxed );
+#else
+    return 0;
+#endif
+}
+
+double
+now()
+{
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double
+cpu_time()
+{
+    rusage ru;
+    getrusage( RUSAGE_SELF, &ru );
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+Options::Options( const vector<string>& args )
+{
+    for( size_t i = 0; i < args.size(); ++i )
+    {
+        const string& a = args[i];
+        if( a.compare( 0, 2, "--" ) != 0 ) continue;
+        size_t eq = a.find( '=' );
+        if( eq == string::npos )
+            m_opts[ a.substr(2) ] = "1";
+        else
+            m_opts[ a.substr( 2, eq-2 ) ] = a.substr( eq+1 );
+    }
+}
+
+Result::Result( const string& bench )
+{
+    m_os << "{\"bench\":\"" << bench << "\"";
+}
+
+Result&
+Result::add( const string& key, double val )
+{
+    m_os << ",\"" << key << "\":" << val;
+    return *this;
+}
+
+Result&
+Result::add( const string& key, const string& val )
+{
+    m_os << ",\"" << key << "\":\"" << val << "\"";
+    return *this;
+}
+
+void
+Result::print() const
+{
+    printf( "%s}\n", m_os.str().c_str() );
+    fflush( stdout );
+}
+
+} //ns
@@ -0,0 +1,125 @@
+#ifndef __LIBF2F_BROADCAST_H__
+#define __LIBF2F_BROADCAST_H__
+
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/recursive_mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <deque>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "libf2f/message.h"
+#include "libf2f/timerwheel.h"
+
+namespace libf2f {
+
+struct broadcast_stats
+{
+    broadcast_stats() : broadcasts(0), direct(0), deferred(0), coalesced(0),
+                        dropped(0), backlog(0), peers_behind(0) {}
+    
+    boost::uint64_t broadcasts;         // broadcast() calls
+    boost::uint64_t direct;             // copies written straight away
+    boost::uint64_t deferred;           // copies held back for a peer..
+    boost::uint64_t coalesced;          // ..superseded by a newer one
+    boost::uint64_t dropped;            // ..or dropped, the backlog was full
+                                        // (or the writeq refused it)
+    size_t backlog;                     // copies held back now
+    size_t peers_behind;                // peers with a backlog now
+};
+
+/// Fair fan-out for broadcasts, see Router::broadcast.
+/// A copy goes straight to a peer while its writeq holds less than
+/// max_queued bytes. Past that the peer is behind, and copies wait in a
+/// backlog for it, where a broadcast with the same type and key replaces
+/// an older one still waiting (which is skipped, the new one is queued
+/// last, so order is kept). Backlogs are drained deficit round robin:
+/// each round a peer with room in its writeq may send another quantum of
+/// bytes. That happens on every broadcast and every timer wheel tick
+/// while anyone is behind. Peers are visited from a rotating start, so
+/// none is always served first. Thread safe.
+class Broadcaster : boost::noncopyable
+{
+public:
+    explicit Broadcaster( Router& r );
+    /// cancels the tick, which may otherwise outlive us on the wheel
+    ~Broadcaster();
+    
+    /// max_backlog is in msgs per peer, the oldest are dropped past it
+    void set_limits( size_t max_queued, size_t max_backlog, size_t quantum );
+    
+    void broadcast( message_ptr msgp, const std::string& key,
+                    const connection_ptr& except );
+    
+    /// forget conn's backlog, it's gone
+    void remove( const connection_ptr& conn );
+    
+    /// copies held back for conn, 0 unless it's behind
+    size_t backlog( const connection_ptr& conn );
+    
+    broadcast_stats stats();
+    
+    static const size_t default_max_queued = 64*1024;
+    static const size_t default_max_backlog = 1024;
+    static const size_t default_quantum = max_payload_size +
+                                          sizeof(message_header);
+
+private:
+    struct pending
+    {
+        pending( const message_ptr& m, const std::string& k )
+            : msg( m ), key( k ) {}
+        
+        message_ptr msg;
+        std::string key;
+    };
+    struct peer
+    {
+        peer( const connection_ptr& c ) : conn( c ), deficit( 0 ) {}
+        
+        connection_ptr conn;
+        std::deque< pending > backlog;
+        size_t deficit;                 // bytes it may still send this round
+    };
+    /// peers that are behind, in round robin order
+    typedef std::list< peer > peer_list;
+    typedef std::vector< std::pair< connection_ptr, message_ptr > > send_list;
+    
+    /// add a copy to p's backlog, m_mutex held
+    void enqueue( peer& p, const message_ptr& msgp, const std::string& key );
+    /// one round over the peers that are behind, m_mutex held
+    void drain( send_list& sends );
+    /// write out sends, then arm the tick if anyone is still behind.
+    /// m_mutex held, so copies reach each peer in broadcast order.
+    void flush( const send_list& sends );
+    void tick();
+    
+    /// what a pending tick holds on to instead of the Broadcaster, which
+    /// clears self when it goes
+    struct tick_guard
+    {
+        boost::mutex mutex;             // held while a tick runs
+        Broadcaster * self;
+    };
+    static void tick_if_alive( boost::shared_ptr<tick_guard> g );
+    
+    Router& m_router;
+    /// recursive: a write may fire a watermark callback that broadcasts
+    boost::recursive_mutex m_mutex;
+    peer_list m_behind;
+    boost::unordered_map< Connection*, peer_list::iterator > m_index;
+    size_t m_next_start;                // rotates the fast path's order
+    bool m_ticking;
+    TimerWheel::timer_id m_tick_timer;  // valid while m_ticking
+    boost::shared_ptr<tick_guard> m_guard;
+    size_t m_max_queued, m_max_backlog, m_quantum;
+    broadcast_stats m_stats;
+};
+
+} //ns
+
+#endif
@@ -11,14 +11,88 @@
 #include <boost/thread/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/thread/future.hpp>
+#include <boost/unordered_map.hpp>
 #include <string>
 #include <sstream>
 #include <vector>
+#include <map>
+#include <algorithm>
 
 #include "libf2f/message.h"
+#include "libf2f/metrics.h"
+#include "libf2f/ratelimit.h"
+#include "libf2f/stream.h"
+#include "libf2f/timerwheel.h"
+
+struct z_stream_s; // zlib
 
 namespace libf2f {
 
+/// Counters describing how well outgoing messages are being coalesced
+/// into gather-writes.
+struct write_stats
+{
+    write_stats() : batches(0), messages(0), bytes(0), max_batch_messages(0),
+                    rejected(0), dropped(0), compressed(0),
+                    compressed_in(0), compressed_out(0), throttled(0),
+                    corked(0), datagrams(0) {}
+    
+    boost::uint64_t batches;            // number of async_write calls issued
+    boost::uint64_t messages;           // number of messages written
+    boost::uint64_t bytes;              // number of bytes written
+    size_t max_batch_messages;          // largest batch seen
+    boost::uint64_t rejected;           // msgs refused by async_write
+    boost::uint64_t dropped;            // msgs discarded by the writeq policy
+    boost::uint64_t compressed;         // msgs sent compressed
+    boost::uint64_t compressed_in;      // their payload bytes before..
+    boost::uint64_t compressed_out;     // ..and after compression
+    boost::uint64_t throttled;          // times writing paused for a rate limit
+    boost::uint64_t corked;             // batches written with TCP_CORK on
+    boost::uint64_t datagrams;          // msgs sent as datagrams instead,
+                                        // not counted in messages / bytes
+};
+
+/// Liveness checks, see Connection::set_liveness. All in ms, 0 is off.
+struct liveness
+{
+    liveness() : idle_ms(0), read_timeout_ms(0), write_timeout_ms(0),
+                 keepalive_ms(0) {}
+    
+    unsigned int idle_ms;               // no msgs either way, control msgs
+                                        // (incl. keepalives) don't count
+    unsigned int read_timeout_ms;       // nothing at all received
+    unsigned int write_timeout_ms;      // a write made no progress
+    unsigned int keepalive_ms;          // ping after this long not sending,
+                                        // give up on a peer that hasn't
+                                        // answered for keepalive_misses
+                                        // times as long
+    
+    static const unsigned int keepalive_misses = 3;
+};
+
+/// Socket tuning, see Connection::set_socket_options.
+struct socket_options
+{
+    /// how a batch is pushed out once it's written to the socket
+    enum send_mode
+    {
+        SEND_NODELAY,   // TCP_NODELAY, straight away
+        SEND_NAGLE,     // the OS default, small writes wait for an ack
+        SEND_ADAPTIVE   // TCP_NODELAY, but corked (TCP_CORK) while more
+                        // batches are queued behind it, so a backlog goes
+                        // out in full segments. A batch with PRIO_HIGH
+                        // msgs in it is never corked. Where there is no
+                        // TCP_CORK this is SEND_NODELAY.
+    };
+    
+    socket_options() : mode( SEND_NODELAY ), sndbuf( 0 ), rcvbuf( 0 ) {}
+    
+    send_mode mode;
+    int sndbuf;                         // SO_SNDBUF, 0 leaves the OS
+    int rcvbuf;                         // default (and its autotuning)
+};
+
 /// This class represents a Connection to one other libf2f user.
 /// it knows how to marshal objects to and from the wire protocol
 /// It keeps some state related to the Connection, eg are they authenticated.
@@ -27,34 +101,237 @@ class Connection
 {
 public:
 
+    /// What async_write does when a msg won't fit in the writeq.
+    /// A msg is always accepted into an empty queue, whatever its size.
+    enum writeq_policy
+    {
+        WRITEQ_UNBOUNDED,   // queue it anyway
+        WRITEQ_REJECT,      // refuse it, async_write returns WRITE_REJECTED
+        WRITEQ_DROP_OLDEST, // discard queued msgs from the front to make room,
+                            // stream traffic and the handshake excepted
+        WRITEQ_DROP_NEWEST, // discard it, async_write returns WRITE_DROPPED
+        WRITEQ_BLOCK        // wait up to the block timeout for room, then
+                            // refuse it with WRITE_TIMEOUT. Never blocks on
+                            // this connection's own strand, don't use it
+                            // from other io threads either.
+    };
+    
+    /// Outgoing msgs are queued in a lane per priority. Lanes are served
+    /// highest first, but a lower lane that has been passed over
+    /// starvation_limit times gets the next send.
+    /// PRIO_HIGH is meant for small control msgs and is exempt from the
+    /// writeq limit, so they can't be refused because of a bulk backlog.
+    enum priority
+    {
+        PRIO_HIGH = 0,
+        PRIO_NORMAL,
+        PRIO_BULK,
+        num_priorities
+    };
+    
+    /// Optional features, offered in a HELLO control msg when the
+    /// connection starts and used if both ends have them. A peer that
+    /// never answers (eg an older libf2f) just gets plain v1.
+    enum capability
+    {
+        CAP_WIRE_V2  = 1 << 0,  // compact v2 framing, see wire.h
+        CAP_COMPRESS = 1 << 1,  // deflated payloads, needs CAP_WIRE_V2
+        CAP_STREAMS  = 1 << 2,  // open_stream
+        CAP_KEEPALIVE = 1 << 3, // answers keepalive pings
+        CAP_DATAGRAM = 1 << 4   // UDP side channel, see
+                                // Router::enable_datagrams
+    };
+    
+    enum write_result
+    {
+        WRITE_QUEUED,
+        WRITE_REJECTED,
+        WRITE_DROPPED,
+        WRITE_TIMEOUT
+    };
+    
     Connection( boost::asio::io_service& io_service, Router * r );
     
     ~Connection();
     
     void close();
     
+    /// Terminate the connection. Safe to call from any thread, if called
+    /// outside the strand it happens asynchronously.
     void fin();
     
+    /// Starts the read loop, after offering our capabilities if we have
+    /// any. Safe to call from any thread.
+    void start();
+    
+    /// capabilities to offer the peer, must be set before start()
+    void set_capabilities( boost::uint32_t caps ) { m_caps = caps; }
+    /// capabilities the peer offered, 0 until its HELLO arrives
+    boost::uint32_t peer_capabilities() const { return m_peer_caps; }
+    /// Payloads of at least threshold bytes are compressed at this zlib
+    /// level once CAP_COMPRESS is negotiated. Must be set before start()
+    void set_compression( size_t threshold, int level );
+    
+    /// Terminate the connection when one of the liveness limits is hit.
+    /// Keepalive pings are only sent once both ends negotiated
+    /// CAP_KEEPALIVE, they keep an idle peer's read timeout from firing
+    /// and measure the round trip, and a peer that stops answering them
+    /// is dropped. Checks run off the Router's timer
+    /// wheel, so they're only as precise as its tick. Set before start().
+    void set_liveness( const liveness& l ) { m_liveness = l; }
+    /// TCP_NODELAY / corking and socket buffer sizes. Set before start(),
+    /// or on the strand to change a running connection's. A rcvbuf set
+    /// after connecting can't raise the window scale the handshake
+    /// agreed on, set it on the Router (or the listening socket) for that.
+    void set_socket_options( const socket_options& o );
+    const socket_options& get_socket_options() const { return m_sockopts; }
+    
+    /// smoothed keepalive round trip in us, incl. time in the writeq.
+    /// 0 until the first pong.
+    boost::uint64_t rtt_us() const { return m_srtt_us.load(); }
+    
+    /// True once the UDP side channel to the peer works, which takes
+    /// CAP_DATAGRAM on both ends and a datagram from us getting through.
+    /// From then on keepalives, and msgs of the Router's datagram types,
+    /// go as datagrams. Any thread.
+    bool datagrams_up() const { return m_dgram_up.load(); }
+    
+    /// true once we're sending / receiving v2 framing
+    bool tx_wire_v2() const { return m_tx_v2; }
+    bool rx_wire_v2() const { return m_rx_v2; }
+    
     /// Get the underlying socket.
     boost::asio::ip::tcp::socket& socket();
     
+    /// All handlers for this connection run through this strand
+    boost::asio::io_service::strand& strand() { return m_strand; }
+    
+    /// which of the Router's io_services this connection uses
+    size_t io_slot() const { return m_io_slot; }
+    void set_io_slot( size_t i ) { m_io_slot = i; }
+    
     /// Asynchronously write a data structure to the socket.
-    /// This just enqueues the data and returns immediately
-    void async_write(message_ptr msg);
+    /// This just enqueues the data and returns immediately, it's safe
+    /// to call from any thread. If the writeq is full what happens depends
+    /// on the writeq_policy.
+    /// The lane is the Router's priority for the msg type, unless given.
+    write_result async_write(message_ptr msg);
+    write_result async_write(message_ptr msg, priority prio);
     /// this is called internally to do actual sending:
-    void do_async_write(const boost::system::error_code& e, message_ptr finished_msg);
+    void do_async_write();
+    
+    /// Stream a payload of any size to the peer. It's read from src as
+    /// the peer's flow control window allows and sent in fragments on the
+    /// PRIO_BULK lane, so it never holds up other msgs. The peer's
+    /// Protocol gets stream_opened (with type, length and meta), then
+    /// stream_data per chunk, then stream_closed.
+    /// done, if given, is called on the strand with true once all of it
+    /// is queued, or false if it was cancelled, refused or failed.
+    /// Returns 0 unless both ends negotiated CAP_STREAMS. Any thread.
+    stream_id open_stream( char type, stream_source src, 
+                           boost::uint64_t length = unknown_stream_length,
+                           const std::string& meta = "",
+                           stream_done_cb done = stream_done_cb() );
+    /// stop sending an outgoing stream, the peer sees it closed incomplete
+    void cancel_stream( stream_id id );
+    
+    /// Stream length bytes of a file from offset, as open_stream does.
+    /// The payload goes from the page cache to the socket with sendfile
+    /// where that's available, it's never copied into userspace.
+    /// Takes ownership of fd. Returns 0 if the region isn't all in the
+    /// file.
+    stream_id send_file( char type, int fd, boost::uint64_t offset,
+                         boost::uint64_t length, const std::string& meta = "",
+                         stream_done_cb done = stream_done_cb() );
+    
+    /// Write an incoming stream's data to fd from offset, instead of
+    /// passing it to Protocol::stream_data. Where splice is available
+    /// the bytes go from the socket to the file without being copied
+    /// into userspace. Takes ownership of fd. Call it on the strand, eg
+    /// from Protocol::stream_opened. Returns false for an unknown stream.
+    /// If writing to fd fails the stream is stopped, or if that happens
+    /// mid-splice the connection is terminated.
+    bool sink_stream( stream_id id, int fd, boost::uint64_t offset = 0 );
+    
+    /// Gets the reply to a request, or an error and a null msg: timed_out,
+    /// or operation_aborted if it was cancelled or the connection
+    /// finished. Runs on the strand.
+    typedef boost::function< void( const boost::system::error_code&,
+                                   message_ptr ) > response_handler;
+    
+    /// Send msgp, and hand the first msg that comes back with the same
+    /// guid to handler instead of dispatching it. The peer answers with
+    /// reply(). Any number of requests can be in flight and they can be
+    /// answered in any order, as long as their guids differ.
+    /// The timeout runs from when the msg is queued, 0 waits forever.
+    /// If this returns WRITE_QUEUED handler is called exactly once.
+    /// Otherwise it isn't, unless the request was cancelled meanwhile.
+    /// A guid that's already in flight is WRITE_REJECTED. A reply that
+    /// turns up after its request timed out is dispatched like any other
+    /// msg. Any thread.
+    write_result request( message_ptr msgp, unsigned int timeout_ms,
+                          response_handler handler );
+    /// As above, the future gets the reply or a boost::system::system_error.
+    /// Don't wait on it from this connection's io thread.
+    boost::unique_future<message_ptr> request( message_ptr msgp,
+                                               unsigned int timeout_ms );
+    /// give up on a request, its handler gets operation_aborted. Returns
+    /// false if it had already completed. Any thread.
+    bool cancel_request( const message_ptr& msgp );
+    /// send response as the reply to request, by giving it request's guid
+    write_result reply( const message_ptr& request, message_ptr response );
+    /// requests waiting for a reply
+    size_t requests_in_flight() const { return m_num_requests.load(); }
+    
+    /// Handle completion of a gather-write of a batch of messages
+    void handle_write(const boost::system::error_code& e, std::size_t bytes);
+    
+    /// Limit what this connection sends to bytes_per_sec, 0 for no limit.
+    /// See TokenBucket for burst. The Router's global limit applies too.
+    /// While either is in debt writing pauses, and resumes off the timer
+    /// wheel, so a burst under a wheel tick's worth (bytes_per_sec/100)
+    /// holds throughput below the limit. Any thread.
+    void set_send_rate( boost::uint64_t bytes_per_sec, 
+                        boost::uint64_t burst = 0 )
+    {
+        m_send_bucket.set_rate( bytes_per_sec, burst );
+    }
     
-    /// Setup a call to read the next msg_header
+    /// Limits on how much of the writeq is coalesced into one gather-write.
+    /// A batch always contains at least one message.
+    void set_write_coalescing( size_t max_bytes, size_t max_buffers );
+    
+    write_stats get_write_stats();
+    
+    /// Traffic, writeq and latency counters. Cheap enough to poll, takes
+    /// the writeq lock briefly. Any thread.
+    connection_metrics get_metrics();
+    
+    /// Set the writeq policy and limit in bytes. Also resets the
+    /// watermarks to 3/4 and 1/4 of max_bytes.
+    void set_writeq_policy( writeq_policy p, size_t max_bytes, 
+                            unsigned int block_timeout_ms = 0 );
+    
+    /// How many times a non-empty lane can be passed over for a higher one
+    void set_starvation_limit( unsigned int n );
+    
+    /// Protocol::writeq_high_watermark is called when the writeq grows to
+    /// high bytes, then writeq_low_watermark once it has drained to low.
+    void set_writeq_watermarks( size_t low, size_t high );
+    
+    /// Setup a read of whatever the socket has into the receive buffer
     void async_read();
     
-    /// Handle a completed read of a message header
-    void handle_read_header(const boost::system::error_code& e, message_ptr msgp);
+    /// Handle a completed read into the receive buffer, dispatches every
+    /// complete message in it and carries any partial one over.
+    void handle_read(const boost::system::error_code& e, std::size_t bytes);
+    
+    /// number of msgs / bytes queued, in total or in one lane
+    size_t writeq_size() const;
+    size_t writeq_bytes() const { return m_writeq_size; }
+    size_t writeq_size( priority prio ) const { return m_lanes[prio].q.size(); }
+    size_t writeq_bytes( priority prio ) const { return m_lanes[prio].bytes; }
     
-    /// Handle a completed read of message, with payload attached
-    void handle_read_data(const boost::system::error_code& e, message_ptr msgp);
-
-    size_t writeq_size() const { return m_writeq.size(); }
-
     void push_message_received_cb( boost::function< void(message_ptr, connection_ptr) > cb );
     void pop_message_received_cb();
     
@@ -63,7 +340,8 @@ public:
     const bool ready() const { return m_ready; }
     void set_ready( bool b ) { m_ready = b; }
     const std::string& name() const { return m_name; }
-    void set_name( const std::string& n ) { m_name = n; }
+    /// also updates the Router's name index
+    void set_name( const std::string& n );
     
     /// get/set api for storing things associated with the connection
     /// bit of a hack, exposes weakness in api/design atm IMO.
@@ -79,14 +357,328 @@ public:
         return m_props[key];
     }
     
+    /// default limit on bytes in the writeq
+    static const size_t default_max_writeq_size = 4*1024*1024;
+    
+    static const unsigned int default_starvation_limit = 16;
+    
+    /// smaller payloads aren't worth compressing
+    static const size_t default_compress_threshold = 256;
+    static const int default_compress_level = 6;
+    
+    /// bytes of stream data per fragment
+    static const size_t stream_fragment_size = 8*1024;
+    /// ..or of a file, which costs no memory so may as well be max size
+    static const size_t file_fragment_size = max_payload_size - 5;
+    /// read size past the end of the msg being received while a stream
+    /// is sinking to a file, small so that most payload bytes are left in
+    /// the socket to be spliced
+    static const size_t sink_read_size = 256;
+    /// bytes of a stream that may be unacknowledged by the receiver
+    static const size_t stream_window = 256*1024;
+    
+    /// default limits on a single gather-write batch
+    static const size_t default_batch_bytes = 64*1024;
+    static const size_t default_batch_buffers = 64;
+    
+    /// size of the per-connection receive buffer, must hold a max size msg
+    static const size_t rx_buffer_size = 64*1024;
+    
 private:
+    /// control msg payload is a subtype byte, then for the handshake a
+    /// big-endian uint32 of caps, or for streams a big-endian stream_id
+    enum control_subtype
+    {
+        CTRL_HELLO = 1,         // caps we offer
+        CTRL_ACK,               // caps we'll use from the next msg on
+        CTRL_STREAM_OPEN,       // type, uint64 length, meta
+        CTRL_STREAM_DATA,       // a fragment
+        CTRL_STREAM_END,        // all sent
+        CTRL_STREAM_ABORT,      // sender gave up, stream is incomplete
+        CTRL_STREAM_STOP,       // receiver refused it or wants no more
+        CTRL_STREAM_WINDOW,     // uint32 more bytes the sender may send
+        CTRL_PING,              // uint32 sequence number..
+        CTRL_PONG,              // ..echoed back
+        CTRL_DGRAM_OFFER,       // uint32 token, uint16 udp port
+        CTRL_DGRAM_PROBE,       // a datagram, to see if they get through..
+        CTRL_DGRAM_OK           // ..and they do
+    };
+    
+    /// fin() without the strand, for Router::stop() when nothing else
+    /// can be running this connection's handlers
+    void fin_inline();
+    
+    /// queue msg for sending, limited says if the writeq policy applies
+    write_result queue_write( message_ptr msg, priority prio, bool limited );
+    
+    /// streams, see stream.cpp. All on the strand:
+    struct out_stream;
+    void start_stream( stream_id id, char type, boost::uint64_t length, 
+                       const std::string& meta, out_stream s );
+    /// send fragments of outgoing streams while they have window
+    void pump_streams();
+    void end_stream( stream_id id, bool ok, bool tell_peer );
+    void handle_stream_control( message_ptr msgp );
+    /// a stream control msg with room for extra bytes after the id
+    message_ptr stream_msg( char subtype, stream_id id, size_t extra );
+    void close_streams();
+    /// stream data was consumed, returns window credit when it's due
+    void stream_consumed( stream_id id, size_t len );
+    /// write data for a sinking stream, false if that failed
+    bool sink_write( stream_id id, const char * data, size_t len );
+    /// sinking stream fragment at the front of the receive buffer, hlen
+    /// is its header size. returns bytes of the buffer consumed, sets
+    /// m_splice_left if the rest must be spliced from the socket.
+    size_t sink_fragment( size_t off, size_t hlen, size_t len );
+    /// send the file part of m_sendfile, then carry on writing
+    void continue_sendfile();
+    /// splice m_splice_left bytes from the socket, then carry on reading
+    void continue_splice();
+    /// wait for the socket to be writable (or readable) then continue
+    /// the sendfile (or splice)
+    void wait_socket( bool write );
+    void handle_wait( const boost::system::error_code& e, bool write );
+    
+    /// requests, see rpc.cpp:
+    typedef boost::array< char, 36 > guid_key;
+    struct guid_key_hash
+    {
+        size_t operator()( const guid_key& k ) const;
+    };
+    struct pending_request
+    {
+        response_handler handler;
+        TimerWheel::timer_id timer;     // 0 if there's no timeout
+    };
+    typedef boost::unordered_map< guid_key, pending_request, guid_key_hash >
+        request_map;
+    static guid_key request_key( const message_ptr& msgp );
+    /// take request k out of m_requests and post its handler with e and
+    /// msgp to the strand. false if it wasn't pending.
+    bool complete_request( const guid_key& k,
+                           const boost::system::error_code& e,
+                           message_ptr msgp );
+    static void request_timed_out( connection_ptr_weak conn, guid_key k );
+    /// fail all pending requests with operation_aborted, for fin
+    void abort_requests();
+    
+    /// liveness, see liveness.cpp. All on the strand:
+    /// arm the wheel timer for the next deadline, if there is one
+    void schedule_liveness();
+    static void liveness_timer( connection_ptr_weak conn );
+    /// fin if a limit was hit, send a ping if one is due
+    void check_liveness();
+    void handle_pong( boost::uint32_t seq );
+    /// the keepalive is due this long after we last sent anything,
+    /// datagram pings included
+    boost::uint64_t keepalive_from() const
+    {
+        return std::max( m_last_tx, m_last_ping );
+    }
+    
+    /// the UDP side channel, see datagram.cpp. All on the strand except
+    /// send_datagram:
+    /// register with the Router's DatagramSocket, tell the peer our token
+    void offer_datagrams();
+    /// the peer's offer, probe whether our datagrams get through
+    void handle_datagram_offer( message_ptr msgp );
+    /// a msg that came as a datagram, of bytes on the wire
+    void handle_datagram( message_ptr msgp, size_t bytes );
+    /// queue msgp as a datagram to the peer, false if it's too big
+    bool send_datagram( const message_ptr& msgp );
+    
+    /// parse complete messages out of the receive buffer and dispatch them.
+    /// returns false if the connection was terminated while doing so.
+    bool dispatch_buffered();
+    /// parse the header at the front of the len bytes at p, in whichever
+    /// wire format is in use. *zlen is the compressed payload length, or
+    /// 0 if it isn't. returns header size, 0 if incomplete, -1 if malformed.
+    int parse_header( const char * p, size_t len, message_header& h,
+                      boost::uint32_t * zlen );
+    /// inflate zlen bytes at p into msgp's payload, false on error
+    bool inflate_payload( const char * p, size_t zlen, message_ptr msgp );
+    /// hand a received message to the callback stack / router
+    void dispatch_message(message_ptr msgp);
+    /// handle one of libf2f's own control msgs
+    void handle_control(message_ptr msgp);
+    /// send a control msg of this subtype carrying caps (or a ping's
+    /// sequence number), as a datagram if asked and the channel is up
+    void send_control( char subtype, boost::uint32_t caps, bool switch_tx,
+                       bool datagram = false );
+    /// add msgp's buffers to m_write_bufs, returns the number added
+    size_t append_write_buffers( const message_ptr& msgp );
+    /// as above for a msg to be deflated: adds 2 empty buffers and
+    /// reserves room in m_txz for deflate_batch() to fill. m_mutex held.
+    void reserve_compressed_buffers( const message_ptr& msgp );
+    /// deflate the batch's reserved msgs, strand only. Done outside
+    /// m_mutex so writers from other threads don't wait on it.
+    void deflate_batch();
+    /// room needed in m_txz to compress len bytes
+    size_t compress_bound( size_t len ) const;
+    /// write the batch out, unless a rate limit says to wait, in which case
+    /// it's retried from the timer wheel. Strand only.
+    void start_batch();
+    /// set the socket options in m_sockopts, strand only
+    void apply_socket_options();
+    /// TCP_CORK on or off, if it isn't already. Strand only.
+    void set_cork( bool on );
+    static void resume_batch( connection_ptr_weak conn );
+    /// move messages from the writeq into the next batch, m_mutex held.
+    /// returns false if there is nothing to send.
+    bool fill_write_batch();
+    /// lane the next msg should be sent from, m_mutex held.
+    /// returns num_priorities if all lanes are empty.
+    size_t pick_lane() const;
+    /// apply the writeq policy so a msg of len bytes fits, m_mutex held.
+    write_result make_room( boost::mutex::scoped_lock& lk, size_t len );
+    /// true if the writeq just drained to the low watermark, m_mutex held.
+    bool crossed_low_watermark();
+    void fire_watermark( bool high );
     
     boost::asio::ip::tcp::socket m_socket; // underlying socket
+    boost::asio::io_service::strand m_strand;
+    size_t m_io_slot;
+    
+    std::vector<char> m_rxbuf;          // receive buffer
+    size_t m_rxbuf_len;                 // bytes of unparsed data in m_rxbuf
+    size_t m_rx_need;                   // more the msg at its front needs,
+                                        // 0 if we don't know yet
     
     boost::mutex m_mutex;               // protects outgoing message queue
-    std::deque< message_ptr > m_writeq; // queue of outgoing messages
+    /// a queued msg and when it was queued (now_us), for queue_wait
+    struct queued
+    {
+        queued( const message_ptr& m, boost::uint64_t t, bool e ) 
+            : msg( m ), since( t ), evictable( e ) {}
+        
+        message_ptr msg;
+        boost::uint64_t since;
+        /// WRITEQ_DROP_OLDEST may drop it. Stream traffic and the
+        /// handshake aren't, the peer can't do without them.
+        bool evictable;
+    };
+    /// queue of outgoing messages for one priority
+    struct lane
+    {
+        lane() : bytes(0), passed_over(0) {}
+        
+        std::deque< queued > q;
+        size_t bytes;                   // bytes queued in this lane
+        unsigned int passed_over;       // sends from higher lanes since 
+                                        // this one was last served
+    };
+    lane m_lanes[num_priorities];       // the writeq
+    unsigned int m_starvation_limit;
     size_t m_writeq_size;               // number of bytes in the writeq
     size_t max_writeq_size;             // max number of bytes in the queue
+    writeq_policy m_writeq_policy;
+    unsigned int m_block_timeout_ms;    // for WRITEQ_BLOCK
+    boost::condition_variable m_writeq_cond; // signalled when writeq shrinks
+    size_t m_blocked_writers;           // callers waiting on m_writeq_cond
+    size_t m_writeq_lowat, m_writeq_hiwat;
+    bool m_writeq_high;                 // above high watermark, not yet low
+    
+    /// messages being written, kept alive until the whole batch completes:
+    std::vector< message_ptr > m_write_batch;
+    std::vector< boost::asio::const_buffer > m_write_bufs;
+    size_t m_batch_max_bytes;
+    size_t m_batch_max_buffers;
+    write_stats m_write_stats;          // protected by m_mutex
+    boost::uint64_t m_write_started;    // now_us when the batch was issued
+    TokenBucket m_send_bucket;
+    bool m_throttled;                   // the batch is waiting for a rate
+                                        // limit, strand only
+    socket_options m_sockopts;          // strand only
+    bool m_cork_batch;                  // SEND_ADAPTIVE wants the batch
+                                        // corked, m_mutex
+    bool m_corked;                      // TCP_CORK is on, strand only
+    
+    /// metrics not covered by m_write_stats, updated without locking:
+    boost::atomic<boost::uint64_t> m_msgs_in, m_bytes_in;
+    Histogram m_write_latency;
+    Histogram m_queue_wait;
+    
+    /// capability negotiation:
+    boost::uint32_t m_caps;             // what we offer
+    boost::uint32_t m_peer_caps;        // what the peer offered
+    bool m_rx_v2;                       // parsing v2 framing, strand only
+    bool m_tx_v2;                       // sending v2 framing, m_mutex
+    message_ptr m_tx_switch;            // the ACK, caps are used after it
+    boost::uint32_t m_tx_switch_caps;
+    std::vector<char> m_txhdr;          // encoded v2 headers of the batch
+    
+    /// compression, each direction is one deflate stream:
+    bool m_tx_compress;                 // m_mutex
+    size_t m_compress_threshold;
+    int m_compress_level;
+    z_stream_s * m_deflate;             // strand only, null until used
+    z_stream_s * m_inflate;             // strand only, null until used
+    std::vector<char> m_txz;            // compressed payloads of the batch
+    size_t m_txz_used;                  // reserved so far
+    std::vector< boost::asio::const_buffer > m_zin; // payload being deflated
+    /// msgs of the batch still to deflate: their first buffer in
+    /// m_write_bufs, index in m_write_batch and room in m_txz
+    struct pending_deflate
+    {
+        size_t buf, msg, zoff;
+    };
+    std::vector< pending_deflate > m_deflate_pending;
+    
+    /// streams, strand only:
+    struct out_stream
+    {
+        out_stream() : credit( stream_window ), offset( 0 ), remaining( 0 ) {}
+        
+        stream_source src;
+        size_t credit;          // bytes we may send before a window update
+        stream_done_cb done;
+        fd_ptr file;            // for send_file, instead of src
+        boost::uint64_t offset, remaining;
+    };
+    struct in_stream
+    {
+        in_stream() : unacked( 0 ), sink_offset( 0 ) {}
+        
+        size_t unacked;         // bytes consumed but not yet credited
+        fd_ptr sink;            // for sink_stream
+        boost::uint64_t sink_offset;
+    };
+    std::map< stream_id, out_stream > m_out_streams;
+    std::map< stream_id, in_stream > m_in_streams;
+    boost::atomic<stream_id> m_next_stream_id;
+    size_t m_num_sinks;                 // in streams with a sink
+    message_ptr m_sendfile;             // msg whose file part is being sent
+    size_t m_sendfile_done;             // bytes of it sent so far
+    stream_id m_splice_id;              // sinking stream being spliced..
+    size_t m_splice_left;               // ..and bytes of it still to do
+    int m_pipe[2];                      // for splice, -1 until used
+    
+    /// requests waiting for a reply, by guid:
+    boost::mutex m_rpc_mutex;           // protects m_requests
+    request_map m_requests;
+    boost::atomic<size_t> m_num_requests; // its size, read without the lock
+    
+    /// liveness, times are now_us. Strand only unless noted:
+    liveness m_liveness;
+    TimerWheel::timer_id m_liveness_timer; // 0 if not armed
+    boost::uint64_t m_last_rx;          // bytes last read
+    boost::uint64_t m_last_tx;          // a write last started or progressed
+    boost::atomic<boost::uint64_t> m_last_msg; // non-control msg in or out
+    boost::uint32_t m_ping_seq;         // of the outstanding ping..
+    boost::uint64_t m_ping_sent;        // ..and when, 0 if none
+    boost::uint64_t m_last_ping;        // when the last ping was sent
+    boost::uint64_t m_ping_unanswered;  // the first since the last pong,
+                                        // 0 if none
+    boost::atomic<boost::uint64_t> m_srtt_us;
+    Histogram m_rtt;
+    
+    /// side channel, strand only unless noted:
+    boost::uint32_t m_dgram_token;      // the peer sends with it, 0 if none
+    bool m_dgram_probed;                // the peer's probe got here
+    /// where we send, set once before m_dgram_up, so any thread after it:
+    boost::asio::ip::udp::endpoint m_dgram_peer;
+    boost::uint32_t m_dgram_peer_token; // 0 until the peer's offer
+    boost::atomic<bool> m_dgram_up;     // the peer got our probe
     
     /// Stateful stuff the protocol handler/servent will set:
     std::string m_name; // "name" of user at end of Connection
@@ -102,6 +694,8 @@ private:
     
     Router * m_router;
     
+    friend class Router; // sets m_name under its registry lock
+    friend class DatagramSocket; // delivers to handle_datagram
 };
 
 } //ns
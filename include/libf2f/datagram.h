@@ -0,0 +1,142 @@
+#ifndef __LIBF2F_DATAGRAM_H__
+#define __LIBF2F_DATAGRAM_H__
+
+#include <boost/asio.hpp>
+#include <boost/array.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <vector>
+
+#include "libf2f/message.h"
+
+namespace libf2f {
+
+struct datagram_stats
+{
+    datagram_stats() : sent(0), received(0), dropped(0), rejected(0),
+                       send_calls(0), recv_calls(0) {}
+    
+    boost::uint64_t sent;               // datagrams sent..
+    boost::uint64_t received;           // ..and received
+    boost::uint64_t dropped;            // not sent, the queue was full or
+                                        // the socket refused them
+    boost::uint64_t rejected;           // received but malformed, or not
+                                        // from a connection we know
+    boost::uint64_t send_calls;         // sendmmsg / recvmmsg calls, how
+    boost::uint64_t recv_calls;         // well datagrams are batched
+};
+
+/*
+    A UDP side channel shared by a Router's connections, see
+    Router::enable_datagrams. Each datagram carries one msg:
+        
+        Bytes   Description
+        -------------------
+        0-3     Token, big-endian, picked by the receiver when the
+                channel was negotiated, it says which connection the
+                msg belongs to
+        4-      v2 header (see wire.h), never compressed
+        ..      Payload
+    
+    Nothing is resent, datagrams that are lost are lost, and they can
+    arrive out of order with each other and with the TCP connection.
+*/
+class DatagramSocket
+: public boost::enable_shared_from_this<DatagramSocket>, boost::noncopyable
+{
+public:
+    /// bound to ep, receiving once start() is called
+    static boost::shared_ptr<DatagramSocket> create(
+                                    boost::asio::io_service& ios,
+                                    const boost::asio::ip::udp::endpoint& ep );
+    
+    boost::asio::ip::udp::endpoint local_endpoint() const;
+    
+    void start();
+    /// closes the socket, nothing is sent or received after this
+    void stop();
+    
+    /// A token for conn's peer to put on what it sends us, valid until
+    /// remove(). Datagrams with it are only taken from peer's address.
+    boost::uint32_t add( const connection_ptr& conn,
+                         const boost::asio::ip::address& peer );
+    void remove( boost::uint32_t token );
+    
+    /// Queue msgp for to, with to's token for us. Sent in a batch with
+    /// whatever else is queued, from the io thread. Returns false if it
+    /// doesn't fit in one datagram. If the queue is full it's dropped,
+    /// which still counts as sent. Any thread.
+    bool send( const boost::asio::ip::udp::endpoint& to,
+               boost::uint32_t token, const message_ptr& msgp );
+    
+    /// true if msgp fits in one datagram
+    static bool fits( const message_ptr& msgp );
+    
+    datagram_stats stats();
+    
+    /// whole datagram, small enough not to be fragmented on the usual
+    /// 1500 byte MTU
+    static const size_t max_datagram_size = 1400;
+    /// datagrams per sendmmsg / recvmmsg
+    static const size_t batch_size = 32;
+    /// datagrams waiting to be sent
+    static const size_t max_queued = 1024;
+    /// SO_RCVBUF and SO_SNDBUF
+    static const int socket_buffer_size = 1024*1024;
+
+private:
+    DatagramSocket( boost::asio::io_service& ios,
+                    const boost::asio::ip::udp::endpoint& ep );
+    
+    struct outgoing
+    {
+        boost::asio::ip::udp::endpoint to;
+        size_t len;
+        boost::array< char, max_datagram_size > data;
+    };
+    struct peer
+    {
+        connection_ptr_weak conn;
+        boost::asio::ip::address addr;
+    };
+    
+    /// wait for the socket to be readable, then receive()
+    void async_wait();
+    void handle_readable( const boost::system::error_code& e );
+    /// read whatever is waiting, a batch at a time
+    void receive();
+    /// decode one datagram and hand it to its connection's strand,
+    /// false if it isn't for any of them
+    bool deliver( const char * p, size_t len,
+                  const boost::asio::ip::address& from );
+    /// send everything queued, on the io thread
+    void flush();
+    /// send n datagrams from q, returns how many went before one failed
+    size_t send_batch( const outgoing * q, size_t n );
+    
+    boost::asio::ip::udp::socket m_socket;
+    boost::asio::io_service::strand m_strand; // flush runs on it
+    
+    boost::mutex m_mutex;               // protects everything below
+    std::vector< outgoing > m_queue;    // first m_queued are waiting
+    size_t m_queued;
+    std::vector< outgoing > m_sending;  // swapped with m_queue, m_strand
+    std::vector< boost::asio::const_buffer > m_scratch; // payload buffers
+    boost::unordered_map< boost::uint32_t, peer > m_peers; // by token
+    boost::uint32_t m_next_token;
+    datagram_stats m_stats;
+    bool m_stopped;
+    
+    /// receive buffers, io thread only
+    std::vector< char > m_rxbuf;
+};
+
+typedef boost::shared_ptr<DatagramSocket> datagram_socket_ptr;
+
+} //ns
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef __LIBF2F_GUIDCACHE_H__
+#define __LIBF2F_GUIDCACHE_H__
+
+#include <boost/cstdint.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread_time.hpp>
+#include <vector>
+
+namespace libf2f {
+
+struct guid_cache_stats
+{
+    guid_cache_stats() : hits(0), misses(0), rotations(0) {}
+    
+    boost::uint64_t hits;       // guids already seen (duplicates)
+    boost::uint64_t misses;     // new guids
+    boost::uint64_t rotations;  // generations retired
+};
+
+/// Bounded set of recently seen msg GUIDs, for duplicate suppression.
+/// GUIDs are kept as 64 bit hashes in two fixed size open addressed
+/// tables, so memory never grows and nothing is allocated after
+/// construction. The current generation is retired when it holds capacity
+/// guids or is max_age_ms/2 old, so a guid is remembered for at least
+/// capacity inserts or max_age_ms/2, whichever comes first, and never for
+/// more than max_age_ms. A max_age_ms under 2 is taken as 2, the shortest
+/// generation is 1ms. Thread safe.
+class GuidCache
+{
+public:
+    GuidCache( size_t capacity, unsigned int max_age_ms );
+    
+    /// true if this 36 byte guid was seen already, otherwise remembers it
+    bool check_and_insert( const char * guid );
+    
+    guid_cache_stats stats();
+    
+private:
+    typedef std::vector<boost::uint64_t> table;
+    
+    static boost::uint64_t hash( const char * guid );
+    /// true if k is in t, otherwise sets *slot to where it would go
+    bool find( const table& t, boost::uint64_t k, size_t * slot ) const;
+    void rotate( const boost::system_time& now );
+    
+    boost::mutex m_mutex;
+    table m_gen[2];             // 0 marks an empty slot
+    size_t m_cur;               // index of the current generation
+    size_t m_count;             // guids in the current generation
+    size_t m_capacity;
+    size_t m_mask;
+    boost::posix_time::time_duration m_gen_age;
+    boost::system_time m_gen_started;
+    guid_cache_stats m_stats;
+};
+
+} //ns
+
+#endif
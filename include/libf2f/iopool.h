@@ -0,0 +1,53 @@
+#ifndef __LIBF2F_IOPOOL_H__
+#define __LIBF2F_IOPOOL_H__
+
+#include <boost/asio.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include <vector>
+
+namespace libf2f {
+
+/// A set of io_services, each run by its own thread, that connections are
+/// spread across. Handlers for one connection are serialized by its strand.
+class IoServicePool
+{
+public:
+    enum policy
+    {
+        ROUND_ROBIN,
+        LEAST_LOADED    // fewest connections, ties broken round robin
+    };
+    
+    /// starts n threads, n=0 means one per core.
+    IoServicePool( size_t n, policy p = LEAST_LOADED );
+    
+    ~IoServicePool();
+    
+    size_t size() const { return m_services.size(); }
+    
+    boost::asio::io_service& io_service( size_t i ) { return *m_services[i]; }
+    
+    /// index of the io_service a new connection should use
+    size_t pick();
+    
+    /// adjust the number of connections using io_service i
+    void add_load( size_t i, int delta );
+    
+    /// stops all io_services and joins their threads.
+    void stop();
+    
+private:
+    std::vector< boost::shared_ptr<boost::asio::io_service> > m_services;
+    std::vector< boost::shared_ptr<boost::asio::io_service::work> > m_work;
+    boost::thread_group m_threads;
+    
+    boost::mutex m_mutex;       // protects m_load and m_next
+    std::vector< size_t > m_load;
+    size_t m_next;
+    policy m_policy;
+};
+
+} //ns
+
+#endif
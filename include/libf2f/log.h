@@ -0,0 +1,99 @@
+#ifndef __LIBF2F_LOG_H__
+#define __LIBF2F_LOG_H__
+
+#include <boost/cstdint.hpp>
+#include <boost/shared_ptr.hpp>
+#include <ostream>
+
+namespace libf2f {
+
+/// Log levels. Also plain #defines, so LIBF2F_LOG_MIN_LEVEL can use them.
+#define LIBF2F_LOG_DEBUG    0
+#define LIBF2F_LOG_INFO     1
+#define LIBF2F_LOG_WARN     2
+#define LIBF2F_LOG_ERROR    3
+#define LIBF2F_LOG_NONE     4
+
+enum log_level
+{
+    LOG_DEBUG = LIBF2F_LOG_DEBUG,
+    LOG_INFO  = LIBF2F_LOG_INFO,
+    LOG_WARN  = LIBF2F_LOG_WARN,
+    LOG_ERROR = LIBF2F_LOG_ERROR,
+    LOG_NONE  = LIBF2F_LOG_NONE
+};
+
+/// Levels below this are compiled out altogether, eg build with
+/// -DLIBF2F_LOG_MIN_LEVEL=LIBF2F_LOG_WARN.
+#ifndef LIBF2F_LOG_MIN_LEVEL
+#define LIBF2F_LOG_MIN_LEVEL LIBF2F_LOG_DEBUG
+#endif
+
+/// Where log lines end up. write() is only ever called from the logger's
+/// background thread.
+class LogSink
+{
+public:
+    virtual ~LogSink(){}
+    
+    /// one line, without a trailing newline
+    virtual void write( log_level level, const char * msg, size_t len ) = 0;
+    
+    /// called when the logger has nothing more to write for now
+    virtual void flush(){}
+};
+
+/// The default sink: warnings and errors to stderr, the rest to stdout.
+class StdioSink : public LogSink
+{
+public:
+    virtual void write( log_level level, const char * msg, size_t len );
+    virtual void flush();
+};
+
+/// Replace the sink. Lines already queued may still go to the old one.
+void set_log_sink( boost::shared_ptr<LogSink> sink );
+
+/// Lines below level are skipped at runtime, LOG_INFO by default.
+void set_log_level( log_level level );
+bool log_enabled( log_level level );
+
+/// longest line kept, the rest is cut off
+const size_t log_line_max = 240;
+
+/// The calling thread's line, emptied. It formats straight into a fixed
+/// buffer, so nothing is allocated.
+std::ostream& log_stream();
+
+/// Queue the line formatted in log_stream() for the background thread.
+/// Each thread has its own lock-free ring, so this never waits on other
+/// threads. If the ring is full the line is dropped and counted.
+void log_write( log_level level );
+
+/// Write out everything queued so far, from the calling thread.
+void log_flush();
+
+/// lines dropped because a ring was full
+boost::uint64_t log_dropped();
+
+} //ns
+
+/// LIBF2F_LOG( LOG_WARN, "a " << b ). Formatting only happens if the
+/// level is enabled, and not even the check is compiled in for levels
+/// below LIBF2F_LOG_MIN_LEVEL.
+#define LIBF2F_LOG( level, expr )                                         \
+    do {                                                                  \
+        if( (level) >= LIBF2F_LOG_MIN_LEVEL &&                            \
+            ::libf2f::log_enabled( ::libf2f::log_level( level ) ) )       \
+        {                                                                 \
+            ::libf2f::log_stream() << expr;                               \
+            ::libf2f::log_write( ::libf2f::log_level( level ) );          \
+        }                                                                 \
+    } while( 0 )
+
+#define F2F_DEBUG( expr ) LIBF2F_LOG( LIBF2F_LOG_DEBUG, expr )
+#define F2F_INFO( expr )  LIBF2F_LOG( LIBF2F_LOG_INFO, expr )
+#define F2F_WARN( expr )  LIBF2F_LOG( LIBF2F_LOG_WARN, expr )
+#define F2F_ERROR( expr ) LIBF2F_LOG( LIBF2F_LOG_ERROR, expr )
+
+#endif
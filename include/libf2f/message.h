@@ -3,12 +3,22 @@
 
 #include <boost/asio.hpp>
 #include <boost/asio/buffer.hpp>
+#include <boost/array.hpp>
+#include <boost/atomic.hpp>
+#include <boost/intrusive_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/utility/string_ref.hpp>
+#include <boost/weak_ptr.hpp>
 #include <iostream>
 
+#include "libf2f/pool.h"
+
 namespace libf2f {
 
 class Message;
-typedef boost::shared_ptr<Message> message_ptr;
+/// Messages are refcounted intrusively, so the count lives in the pooled
+/// object and it's recycled when the last message_ptr goes away.
+typedef boost::intrusive_ptr<Message> message_ptr;
 class Connection;
 class Router;
 typedef boost::shared_ptr<Connection> connection_ptr;
@@ -44,6 +54,13 @@ Hops            The number of times the message has been forwarded.
 
 */
 
+/// Hard limit on payload size, bigger messages are a protocol error:
+const boost::uint32_t max_payload_size = 16384;
+
+/// Msg type reserved for libf2f's own connection control msgs (capability
+/// handshake etc). These are handled by Connection, never by the Protocol.
+const char control_msg_type = (char)0xff;
+
 /// All messages start with this header:
 struct message_header
 {
@@ -54,33 +71,51 @@ struct message_header
     boost::uint32_t length;
 };
 
+/// header and in-memory payload, see Message::to_buffers
+typedef boost::array<boost::asio::const_buffer, 2> message_buffers;
+
+/// A header plus a payload allocated from the message allocator.
+/// The accessors are all inline and non-virtual; subclasses only get to
+/// change how the payload is written out (append_payload_buffers,
+/// file_region), so GeneralMessage and friends are just constructors.
 class Message
 {
 public:
 
     Message()
-        : m_payload(0)
+        : m_payload(0), m_payload_cap(0), m_refs(0)
     {}
 
     Message(const message_header& header)
-        : m_payload(0)
+        : m_payload(0), m_payload_cap(0), m_refs(0)
     {
         m_header = header;
-        //std::cout << "CTOR Msg(" << m_guid << ")" << std::endl;
+        //std::cout << "CTOR Msg(" << guid() << ")" << std::endl;
     }
     
     virtual ~Message()
     {
-        //std::cout << "DTOR Msg(" << m_guid << ")" << std::endl;
-        if(m_payload) free(m_payload);
+        //std::cout << "DTOR Msg(" << guid() << ")" << std::endl;
+        free_payload();
+    }
+    
+    /// Message objects (incl. subclasses) come from the message allocator
+    static void * operator new( size_t sz )
+    {
+        return message_allocator()->allocate( sz );
+    }
+    
+    static void operator delete( void * p, size_t sz )
+    {
+        message_allocator()->deallocate( p, sz );
     }
     
-    virtual const boost::uint32_t total_length() const 
+    boost::uint32_t total_length() const 
     {
         return sizeof(message_header) + length();
     }
     
-    virtual const std::string str() const
+    const std::string str() const
     {
         std::ostringstream os;
         os  << "[Msg type:" << (int)type() 
@@ -91,75 +126,144 @@ public:
         return os.str();
     }
     
-    virtual message_header& header() { return m_header; }
-    virtual const char type() const { return m_header.type; }
-    virtual const short ttl() const { return m_header.ttl; }
-    virtual const short hops() const { return m_header.hops; }
-    virtual const boost::uint32_t length() const { return ntohl(m_header.length); }
-    virtual const std::string& guid() const 
+    message_header& header() { return m_header; }
+    const message_header& header() const { return m_header; }
+    char type() const { return m_header.type; }
+    short ttl() const { return m_header.ttl; }
+    short hops() const { return m_header.hops; }
+    boost::uint32_t length() const { return ntohl(m_header.length); }
+    /// view of the 36 guid bytes in the header, valid as long as the msg
+    boost::string_ref guid() const 
     { 
-        if( m_guid.empty() )
-        {
-            m_guid = std::string(m_header.guid, 36);
-        }
-        return m_guid; 
+        return boost::string_ref( m_header.guid, 36 );
     }
     // payload
-    virtual const char * payload() const { return m_payload; }
-    virtual char * payload() { return m_payload; }
-    /// sucks to have to do this really, jsonspirit needs a string or stream:
-    virtual std::string payload_str() const 
+    const char * payload() const { return m_payload; }
+    char * payload() { return m_payload; }
+    /// view of the payload, valid as long as the msg
+    boost::string_ref payload_view() const
+    {
+        return boost::string_ref( m_payload, length() );
+    }
+    /// copies the payload, use payload_view unless you need a string
+    std::string payload_str() const 
     { 
-        std::string s(m_payload, length());
-        return s;
+        return std::string(m_payload, length());
     }
     
-    virtual size_t malloc_payload()
+    size_t malloc_payload()
     {
+        free_payload();
         if( length() == 0 ) return 0;
-        free(m_payload);
-        m_payload = (char*)malloc( length() );
+        m_payload = (char*)message_allocator()->allocate( length() );
+        m_payload_cap = length();
         return length();
     }
     
-    virtual const boost::asio::mutable_buffer payload_buffer() const
+    const boost::asio::mutable_buffer payload_buffer() const
     {
         return boost::asio::buffer( m_payload, length() );
     }
     
-    virtual std::vector<boost::asio::const_buffer> to_buffers() const
+    /// the v1 wire representation, header then payload (which may be an
+    /// empty buffer). Doesn't allocate. Only for msgs whose payload is
+    /// all in memory, the write path uses append_buffers.
+    message_buffers to_buffers() const
+    {
+        message_buffers b = {{
+            boost::asio::buffer( (const char*)&m_header, sizeof(message_header) ),
+            boost::asio::buffer( (const char*)m_payload, m_payload ? length() : 0 )
+        }};
+        return b;
+    }
+    
+    /// appends the wire representation to buffers, returns number added.
+    /// (the write path reuses one vector, so this doesn't allocate)
+    size_t append_buffers( std::vector<boost::asio::const_buffer>& buffers ) const
     {
-        std::vector<boost::asio::const_buffer> buffers;
         buffers.push_back( boost::asio::buffer( 
                             (char*)&m_header, sizeof(message_header) ) );
-        if(length())
-        {
-            buffers.push_back( boost::asio::buffer( m_payload, length() ) );
-        }
-        
-        return buffers;
+        return 1 + append_payload_buffers( buffers );
+    }
+    
+    /// as above, but just the payload. Used when the header is encoded
+    /// differently (wire format v2).
+    virtual size_t append_payload_buffers( std::vector<boost::asio::const_buffer>& buffers ) const
+    {
+        if( !length() ) return 0;
+        buffers.push_back( boost::asio::buffer( m_payload, length() ) );
+        return 1;
+    }
+    
+    /// Some of the payload can be sent straight from a file (sendfile),
+    /// after the bytes from append_payload_buffers. Returns false if
+    /// there isn't a file part, which is the usual case.
+    virtual bool file_region( int * fd, boost::uint64_t * offset, 
+                              size_t * len ) const
+    {
+        return false;
     }
     
 protected:
+    void free_payload()
+    {
+        if( !m_payload ) return;
+        message_allocator()->deallocate( m_payload, m_payload_cap );
+        m_payload = 0;
+        m_payload_cap = 0;
+    }
+    
     message_header m_header;
-    mutable std::string m_guid;
     char * m_payload;
+    size_t m_payload_cap; // size m_payload was allocated with
+    
+private:
+    friend void intrusive_ptr_add_ref( Message * m );
+    friend void intrusive_ptr_release( Message * m );
+    
+    mutable boost::atomic<int> m_refs;
 };
 
+inline void intrusive_ptr_add_ref( Message * m )
+{
+    m->m_refs.fetch_add( 1, boost::memory_order_relaxed );
+}
+
+inline void intrusive_ptr_release( Message * m )
+{
+    if( m->m_refs.fetch_sub( 1, boost::memory_order_release ) == 1 )
+    {
+        boost::atomic_thread_fence( boost::memory_order_acquire );
+        delete m;
+    }
+}
+
 class GeneralMessage : public Message
 {
 public:
     GeneralMessage(const char msgtype, const std::string& body, const std::string& uuid)
+    {
+        init( msgtype, body.data(), body.length(), uuid.data() );
+    }
+    
+    /// straight from a buffer, uuid is 36 bytes
+    GeneralMessage(const char msgtype, const char * body, size_t len, const char * uuid)
+    {
+        init( msgtype, body, len, uuid );
+    }
+    
+private:
+    void init( const char msgtype, const char * body, size_t len, const char * uuid )
     {
         message_header h;
-        memcpy( &h.guid, uuid.data(), 36 );
+        memcpy( &h.guid, uuid, 36 );
         h.type = msgtype;
         h.ttl  = 1;
         h.hops = 0;
-        h.length = htonl( body.length() );
+        h.length = htonl( len );
         m_header = h;
         malloc_payload();
-        memcpy( m_payload, body.data(), body.length() );
+        if( len ) memcpy( m_payload, body, len );
     }
 };
 
@@ -0,0 +1,94 @@
+#ifndef __LIBF2F_METRICS_H__
+#define __LIBF2F_METRICS_H__
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+
+namespace libf2f {
+
+/// monotonic clock in microseconds, for durations only
+boost::uint64_t now_us();
+
+/// Snapshot of a Histogram. Bucket 0 counts zeros, bucket i counts
+/// values in [2^(i-1), 2^i), the last bucket also takes anything bigger.
+struct histogram
+{
+    static const size_t num_buckets = 32;
+    
+    histogram() : count(0), sum(0)
+    {
+        for( size_t i = 0; i < num_buckets; ++i ) buckets[i] = 0;
+    }
+    
+    /// upper bound of the bucket holding quantile q (0..1), 0 if empty
+    boost::uint64_t percentile( double q ) const;
+    double mean() const { return count ? double(sum) / count : 0; }
+    
+    boost::uint64_t buckets[num_buckets];
+    boost::uint64_t count;
+    boost::uint64_t sum;
+};
+
+/// Log2 bucketed histogram. record() is a couple of relaxed atomic adds,
+/// so it's fine on the hot path and from any thread. A snapshot taken
+/// while recording is going on may be off by the in-flight values.
+class Histogram : boost::noncopyable
+{
+public:
+    Histogram();
+    
+    void record( boost::uint64_t v );
+    
+    histogram snapshot() const;
+
+private:
+    boost::atomic<boost::uint64_t> m_buckets[histogram::num_buckets];
+    boost::atomic<boost::uint64_t> m_sum;
+};
+
+/// Counters for one connection, see Connection::get_metrics
+struct connection_metrics
+{
+    connection_metrics() : msgs_in(0), bytes_in(0), msgs_out(0),
+                           bytes_out(0), writeq_msgs(0), writeq_bytes(0),
+                           dropped(0), rejected(0), rtt_us(0) {}
+    
+    boost::uint64_t msgs_in;            // msgs received, incl control msgs
+    boost::uint64_t bytes_in;           // bytes read off the socket
+    boost::uint64_t msgs_out;           // msgs written
+    boost::uint64_t bytes_out;          // bytes written to the socket
+    size_t writeq_msgs;                 // currently queued
+    size_t writeq_bytes;
+    boost::uint64_t dropped;            // msgs discarded by the writeq policy
+    boost::uint64_t rejected;           // msgs refused by async_write
+    histogram write_latency;            // us from issuing a write to its
+                                        // completion
+    histogram queue_wait;               // us a msg spent in the writeq
+    boost::uint64_t rtt_us;             // smoothed keepalive round trip
+    histogram rtt;                      // us, each keepalive round trip
+};
+
+/// Router-wide counters, see Router::get_metrics. They only go up, so
+/// rates come from the difference between two snapshots.
+struct router_metrics
+{
+    router_metrics() : accepted(0), refused(0), connected(0),
+                       connect_failed(0), connections(0), timed_out(0)
+    {
+        for( size_t i = 0; i < 256; ++i ) msgs_in[i] = msgs_out[i] = 0;
+    }
+    
+    boost::uint64_t accepted;           // incoming connections accepted..
+    boost::uint64_t refused;            // ..and refused by the Protocol
+    boost::uint64_t connected;          // outgoing connections made..
+    boost::uint64_t connect_failed;     // ..and failed
+    size_t connections;                 // currently registered
+    boost::uint64_t timed_out;          // closed by a liveness limit
+    boost::uint64_t msgs_in[256];       // msgs received, by type
+    boost::uint64_t msgs_out[256];      // msgs written, by type
+};
+
+} //ns
+
+#endif
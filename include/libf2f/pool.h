@@ -0,0 +1,49 @@
+#ifndef __LIBF2F_POOL_H__
+#define __LIBF2F_POOL_H__
+
+#include <boost/cstdint.hpp>
+#include <cstddef>
+
+namespace libf2f {
+
+/// Interface for the allocator used for Message objects and payloads.
+/// Implementations must be thread safe; memory can be freed on a different
+/// thread to the one that allocated it.
+class Allocator
+{
+public:
+    virtual ~Allocator() {}
+    virtual void * allocate( size_t len ) = 0;
+    /// len is the same value that was passed to allocate()
+    virtual void deallocate( void * p, size_t len ) = 0;
+};
+
+/// Default allocator. Keeps a thread-local free list per size class
+/// (powers of two, 32 bytes up to max_payload_size) so steady-state
+/// allocation never reaches malloc. Larger requests go straight to malloc.
+class PoolAllocator : public Allocator
+{
+public:
+    virtual void * allocate( size_t len );
+    virtual void deallocate( void * p, size_t len );
+};
+
+/// Counters of requests that could not be served from a free list.
+struct pool_stats
+{
+    boost::uint64_t system_allocs;  // calls to malloc
+    boost::uint64_t system_frees;   // calls to free
+};
+
+pool_stats get_pool_stats();
+
+/// The allocator used for messages, a PoolAllocator unless replaced.
+Allocator * message_allocator();
+
+/// Replace the message allocator. Must be done before any messages exist,
+/// since blocks are returned to whichever allocator is current.
+void set_message_allocator( Allocator * a );
+
+} //ns
+
+#endif
@@ -4,8 +4,13 @@
 #include "libf2f/router.h"
 #include "libf2f/connection.h"
 
+#include <boost/function.hpp>
+
 namespace libf2f {
 
+/// handles received msgs of one type, see Protocol::set_handler
+typedef boost::function<void( message_ptr, connection_ptr )> message_handler;
+
 class Protocol
 {
 public:
@@ -15,7 +20,8 @@ public:
 
     virtual void set_router(Router * r) { m_router = r; }
     
-    /// called when a client connects to us
+    /// Called when a client connects to us, on conn's strand. With an io
+    /// pool that can be several io threads at once. Return false to refuse.
     virtual bool new_incoming_connection( connection_ptr conn );
 
     /// called when we opened a socket to a remote servent
@@ -24,11 +30,90 @@ public:
     /// called on a disconnection, for whatever reason
     virtual void connection_terminated( connection_ptr conn ){}
 
-    /// we received a msg from this connection
+    /// we received a msg from this connection whose type has no handler
     virtual void message_received( message_ptr msgp, connection_ptr conn );
     
+    /// Msgs of this type go to handler instead of message_received. The
+    /// table has a slot per type byte, so dispatch is one indexed call.
+    /// Set handlers up before connections start, the table isn't locked.
+    void set_handler( char type, message_handler handler )
+    {
+        m_handlers[ (unsigned char)type ] = handler;
+    }
+    
+    /// As above, but the payload is first decoded into a T by decode,
+    /// which reads msgp->payload() in place and returns false if it's
+    /// malformed. Those msgs go to message_undecodable instead.
+    /// T can't be deduced from a plain function, so call it as
+    /// set_handler<T>( type, &decode_t, handler ).
+    template <typename T>
+    void set_handler( char type, 
+                      boost::function<bool( const message_ptr&, T& )> decode,
+                      boost::function<void( const T&, message_ptr, 
+                                            connection_ptr )> handler )
+    {
+        set_handler( type, boost::bind( &Protocol::decode_and_handle<T>, 
+                                        this, decode, handler, _1, _2 ) );
+    }
+    
+    /// back to message_received for this type
+    void clear_handler( char type )
+    {
+        m_handlers[ (unsigned char)type ].clear();
+    }
+    
+    /// the decoder given to set_handler rejected this msg. Dropped with
+    /// a log line by default.
+    virtual void message_undecodable( message_ptr msgp, connection_ptr conn );
+    
+    /// called by the Router for each msg, runs its type's handler or
+    /// falls back to message_received
+    void dispatch( const message_ptr& msgp, const connection_ptr& conn )
+    {
+        const message_handler& h = m_handlers[ (unsigned char)msgp->type() ];
+        if( h ) h( msgp, conn );
+        else message_received( msgp, conn );
+    }
+    
+    /// the connection's writeq has grown to its high watermark
+    virtual void writeq_high_watermark( connection_ptr conn ){}
+    
+    /// the connection's writeq has drained back down to its low watermark
+    virtual void writeq_low_watermark( connection_ptr conn ){}
+    
+    /// the peer opened a stream (see Connection::open_stream), return true
+    /// to accept it. length may be unknown_stream_length.
+    virtual bool stream_opened( connection_ptr conn, stream_id id, char type,
+                                boost::uint64_t length, 
+                                const std::string& meta ){ return false; }
+    
+    /// the next chunk of an accepted stream. The sender gets flow control
+    /// credit for it once this returns.
+    virtual void stream_data( connection_ptr conn, stream_id id, 
+                              const char * data, size_t len ){}
+    
+    /// an accepted stream is over, complete is false if the sender gave up
+    /// or the connection went away
+    virtual void stream_closed( connection_ptr conn, stream_id id, 
+                                bool complete ){}
+    
 protected:
     Router * m_router;
+    
+private:
+    template <typename T>
+    void decode_and_handle( 
+            const boost::function<bool( const message_ptr&, T& )>& decode,
+            const boost::function<void( const T&, message_ptr, 
+                                        connection_ptr )>& handler,
+            message_ptr msgp, connection_ptr conn )
+    {
+        T val;
+        if( decode( msgp, val ) ) handler( val, msgp, conn );
+        else message_undecodable( msgp, conn );
+    }
+    
+    message_handler m_handlers[256];
 };
 
 } //ns
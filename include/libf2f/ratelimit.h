@@ -0,0 +1,52 @@
+#ifndef __LIBF2F_RATELIMIT_H__
+#define __LIBF2F_RATELIMIT_H__
+
+#include <boost/atomic.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace libf2f {
+
+/// Token bucket for shaping outgoing bytes. It fills at rate bytes/sec
+/// up to burst bytes. Writers take what they send with consume(), which
+/// may leave the bucket in debt, so a write bigger than the burst still
+/// goes out; the next one waits for delay() until the debt is paid.
+/// An unlimited bucket (rate 0, the default) costs one atomic load per
+/// call and never locks. Thread safe.
+class TokenBucket : boost::noncopyable
+{
+public:
+    TokenBucket();
+    
+    /// rate in bytes/sec, 0 for unlimited. A burst of 0 means rate/10.
+    /// Starts full.
+    void set_rate( boost::uint64_t rate, boost::uint64_t burst = 0 );
+    
+    boost::uint64_t rate() const 
+    {
+        return m_rate.load( boost::memory_order_relaxed );
+    }
+    bool limited() const { return rate() != 0; }
+    
+    /// us until the bucket is out of debt, 0 if sending may go ahead
+    boost::uint64_t delay();
+    
+    /// take n bytes out of the bucket
+    void consume( size_t n );
+
+private:
+    /// add what has accumulated since m_last, m_mutex held
+    void refill( boost::uint64_t rate );
+    
+    boost::mutex m_mutex;
+    boost::atomic<boost::uint64_t> m_rate;
+    /// in millionths of a byte, so a refill never rounds anything away:
+    boost::int64_t m_tokens;            // negative is debt
+    boost::int64_t m_burst;
+    boost::uint64_t m_last;             // now_us of the last refill
+};
+
+} //ns
+
+#endif
@@ -3,21 +3,41 @@
 
 #include <boost/asio.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
 #include <boost/thread.hpp>
 #include <boost/lexical_cast.hpp>
 #include "boost/lambda/lambda.hpp"
 #include <boost/lambda/if.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/atomic.hpp>
 #include <iostream>
+#include <list>
 #include <vector>
 
 #include "libf2f/message.h"
+#include "libf2f/broadcast.h"
+#include "libf2f/datagram.h"
+#include "libf2f/guidcache.h"
+#include "libf2f/iopool.h"
+#include "libf2f/connection.h"
+#include "libf2f/metrics.h"
+#include "libf2f/timerwheel.h"
 
 namespace libf2f {
 
 class Protocol;
-class Connection;
+
+/// Counters for the flood routing layer
+struct flood_stats
+{
+    flood_stats() : forwarded(0), ttl_expired(0) {}
+    
+    guid_cache_stats cache;     // hits are duplicates that were dropped
+    boost::uint64_t forwarded;  // msgs forwarded (once per msg, not per peer)
+    boost::uint64_t ttl_expired;// msgs delivered but not forwarded
+};
 
 
 /// aka servent - responsible for managing connections
@@ -30,20 +50,54 @@ public:
     /// acceptor(io_service, 
     ///          boost::asio::ip::tcp::endpoint(
     ///             boost::asio::ip::tcp::v4(), port) )
-    Router( boost::shared_ptr<boost::asio::ip::tcp::acceptor> accp, Protocol * p, boost::function<std::string()> uuidf );
+    /// If io_threads is non-zero the Router owns that many io_services,
+    /// each with its own thread, and spreads connections across them
+    /// according to policy. Otherwise everything runs on the acceptor's
+    /// io_service.
+    Router( boost::shared_ptr<boost::asio::ip::tcp::acceptor> accp, Protocol * p, 
+            boost::function<std::string()> uuidf,
+            unsigned int io_threads = 0,
+            IoServicePool::policy policy = IoServicePool::LEAST_LOADED );
     
-    /// how a new Connection is prepped:
+    typedef boost::shared_ptr<boost::asio::ip::tcp::acceptor> acceptor_ptr;
+    
+    /// how a new Connection is prepped, on an io_service the pool picks
+    /// or on the given io slot:
     connection_ptr new_connection();
+    connection_ptr new_connection( size_t io_slot );
+    
+    /// Accept connections on ep as well, with an acceptor per io_service
+    /// (see io_threads) each bound with SO_REUSEPORT, so the kernel
+    /// spreads incoming connections across them and each io thread
+    /// accepts its own share. Each keeps pending_accepts accepts
+    /// outstanding. Without SO_REUSEPORT there's just the one acceptor.
+    /// Returns the endpoint bound, which gives the port if ep's was 0.
+    /// Throws boost::system::system_error if ep can't be bound. Call it
+    /// before the io_services run, stop() closes these acceptors.
+    boost::asio::ip::tcp::endpoint listen( 
+                        const boost::asio::ip::tcp::endpoint& ep,
+                        unsigned int pending_accepts = default_pending_accepts );
+    static const unsigned int default_pending_accepts = 16;
     
     /// lamest uuid generator ever, please supply your own.
     std::string lame_uuid_gen();
     std::string gen_uuid();
     
-    /// calls io_service::stop on acceptor.
+    /// Terminates all connections, and stops the io_service pool if used.
+    /// Returns once every connection is gone: connections whose io_service
+    /// is running on this thread (or not running at all) are fin'd here,
+    /// the rest on their strands while we wait.
     void stop();
     
-    /// Handle completion of a accept operation.
-    void handle_accept(const boost::system::error_code& e, connection_ptr conn);
+    /// Handle completion of a accept operation. The next accept is
+    /// started before the Protocol is asked about conn, which happens on
+    /// conn's strand. slot is where conn was created, any_slot if the
+    /// pool picked. Errors don't stop accepting unless a was closed: a
+    /// failed handshake is skipped, running out of fds or memory backs
+    /// off for accept_retry_ms.
+    void handle_accept( const boost::system::error_code& e, acceptor_ptr a,
+                        size_t slot, connection_ptr conn );
+    static const size_t any_slot = size_t(-1);
                    
     /// Connect out to a remote Servent:
     void connect_to_remote(boost::asio::ip::tcp::endpoint &endpoint);
@@ -53,48 +107,292 @@ public:
     void handle_connect(const boost::system::error_code& e,
                         boost::asio::ip::tcp::endpoint &endpoint,
                         connection_ptr conn);
-
+    
     /// connection terminated for any reason
     void connection_terminated( connection_ptr conn );
-
+    
     /// Default message recvd callback
     void message_received( message_ptr msgp, connection_ptr conn );
     
+    /// a connection's writeq crossed its high (or low) watermark
+    void writeq_watermark( connection_ptr conn, bool high );
+    
+    /// stream events from connections, passed on to the Protocol
+    bool stream_opened( connection_ptr conn, stream_id id, char type,
+                        boost::uint64_t length, const std::string& meta );
+    void stream_data( connection_ptr conn, stream_id id, 
+                      const char * data, size_t len );
+    void stream_closed( connection_ptr conn, stream_id id, bool complete );
+    
+    /// writeq lane used for msgs of this type, unless async_write is
+    /// given one. Everything is PRIO_NORMAL by default.
+    void set_type_priority( char type, Connection::priority prio )
+    {
+        m_type_priority[ (unsigned char)type ] = prio;
+    }
+    Connection::priority type_priority( char type ) const
+    {
+        return m_type_priority[ (unsigned char)type ];
+    }
+    
+    /// Open the UDP side channel on ep, usually the TCP address with
+    /// port 0, and return where it's bound. Connections made from then
+    /// on offer it with CAP_DATAGRAM, if that's in set_capabilities.
+    /// Throws boost::system::system_error if ep can't be bound.
+    boost::asio::ip::udp::endpoint enable_datagrams( 
+                                const boost::asio::ip::udp::endpoint& ep );
+    /// the side channel, null unless enable_datagrams was called
+    DatagramSocket * datagrams() { return m_datagrams.get(); }
+    
+    /// Msgs of this type are sent as datagrams to peers that have the
+    /// side channel up, if they fit in one, so they're never stuck
+    /// behind bulk data in the writeq. They may be lost or reordered.
+    /// Off for every type by default.
+    void set_datagram_type( char type, bool on )
+    {
+        if( type != control_msg_type ) m_datagram_type[ (unsigned char)type ] = on;
+    }
+    bool datagram_type( char type ) const
+    {
+        return m_datagram_type[ (unsigned char)type ];
+    }
+    
+    /// Gnutella style flooding, off by default. When on, every received
+    /// msg whose GUID was seen recently is dropped. Otherwise its TTL is
+    /// decremented and hops incremented, it's forwarded to all other
+    /// connections if TTL is still above 0, then passed to the Protocol.
+    /// See GuidCache for what cache_size and max_age_ms mean.
+    /// Must be set before any connections exist.
+    void set_flood_routing( bool on, size_t cache_size = 65536,
+                            unsigned int max_age_ms = 60000 );
+    
+    /// send a msg we originated to all connections, remembering its GUID
+    /// so copies flooded back to us are dropped.
+    std::vector<connection_ptr> flood( message_ptr msgp );
+    
+    flood_stats get_flood_stats();
+    
+    /// liveness limits for new connections, see Connection::set_liveness.
+    /// Keepalives also need CAP_KEEPALIVE in set_capabilities.
+    void set_liveness( const liveness& l ) { m_liveness = l; }
+    
+    /// Limit on the bytes/sec sent by all connections together, 0 (the
+    /// default) for none. See Connection::set_send_rate.
+    void set_send_rate( boost::uint64_t bytes_per_sec, 
+                        boost::uint64_t burst = 0 )
+    {
+        m_send_bucket.set_rate( bytes_per_sec, burst );
+    }
+    /// the global limit, connections take what they send from it
+    TokenBucket& send_bucket() { return m_send_bucket; }
+    
+    /// per connection limit given to new connections
+    void set_connection_send_rate( boost::uint64_t bytes_per_sec,
+                                   boost::uint64_t burst = 0 )
+    {
+        m_conn_rate = bytes_per_sec;
+        m_conn_burst = burst;
+    }
+    
+    /// socket options for new connections, see
+    /// Connection::set_socket_options. The buffer sizes also go on the
+    /// sockets listen() opens from then on, so connections accepted on
+    /// them have them from the handshake.
+    void set_socket_options( const socket_options& o ) { m_sockopts = o; }
+    
+    /// Connection::capability bits offered on new connections. 0 (the
+    /// default) skips the handshake, for peers that predate it.
+    void set_capabilities( boost::uint32_t caps ) { m_caps = caps; }
+    
+    /// compression settings for new connections, see 
+    /// Connection::set_compression. Only used with CAP_COMPRESS.
+    void set_compression( size_t threshold, int level )
+    {
+        m_compress_threshold = threshold;
+        m_compress_level = level;
+    }
+    
+    /// writeq policy and limit given to new connections
+    void set_writeq_policy( Connection::writeq_policy p, size_t max_bytes,
+                            unsigned int block_timeout_ms = 0 );
+    
+    /// Immutable copy of the connection set. Broadcasts iterate one of
+    /// these without holding the registry lock; a connection that goes
+    /// away meanwhile may still be visited, its writes are just ignored.
+    typedef std::vector< connection_ptr > conn_snapshot;
+    typedef boost::shared_ptr< const conn_snapshot > conn_snapshot_ptr;
+    
+    /// current snapshot, rebuilt by the first caller after a change
+    conn_snapshot_ptr connections();
+    
     /// apply function to all registered connections
     void foreach_conns( boost::function<void(connection_ptr)> );
     
     /// apply function to all registered connections *except* conn
     void foreach_conns_except( boost::function<void(connection_ptr)> fun, connection_ptr conn );
     
-    /// send msg to all registered connections
-    void send_all( message_ptr msgp );
+    /// send msg to all registered connections.
+    /// returns the connections that refused it because their writeq was full
+    std::vector<connection_ptr> send_all( message_ptr msgp );
+    
+    /// Send msg to all registered connections (except one, if given)
+    /// through the Broadcaster, so slow peers get a backlog instead of a
+    /// full writeq and are served fairly as they catch up. A broadcast
+    /// with a non-empty key replaces an earlier one of the same type and
+    /// key that a peer hasn't been sent yet, eg for state updates where
+    /// only the latest matters.
+    void broadcast( message_ptr msgp, const std::string& key = "",
+                    connection_ptr except = connection_ptr() )
+    {
+        m_broadcaster->broadcast( msgp, key, except );
+    }
+    /// limits and stats for broadcast()
+    Broadcaster& broadcaster() { return *m_broadcaster; }
     
     std::string connections_str();
     std::vector<std::string> get_connected_names();
     
+    /// a registered connection with this name, null if none. If several
+    /// share the name you get one of them. Unnamed connections aren't
+    /// indexed, so "" never matches.
     connection_ptr get_connection_by_name( const std::string &name );
-
     
-private:
-    /// Router keeps track of connections:
+    size_t num_connections();
+    
+    /// accept/connect counts and msgs by type. Cheap, any thread. For
+    /// traffic on each connection see Connection::get_metrics.
+    router_metrics get_metrics();
+    
+    /// called by connections for each msg read / written
+    void count_msg_in( char type )
+    {
+        m_msgs_in[ (unsigned char)type ].fetch_add( 1, boost::memory_order_relaxed );
+    }
+    void count_msg_out( char type )
+    {
+        m_msgs_out[ (unsigned char)type ].fetch_add( 1, boost::memory_order_relaxed );
+    }
+    /// called by a connection that hit a liveness limit
+    void count_timed_out()
+    {
+        m_timed_out.fetch_add( 1, boost::memory_order_relaxed );
+    }
+    
+    /// Timers for connections on io_service io_slot (see
+    /// Connection::io_slot), they fire on that io_service. One wheel per
+    /// io_service, so timeouts for thousands of connections cost one
+    /// deadline_timer each.
+    TimerWheel& timers( size_t io_slot = 0 ) { return *m_timers[io_slot]; }
+    
+    /// Router keeps track of connections. This is done on accept/connect,
+    /// only custom transports (and benchmarks) need to call these.
     void register_connection( connection_ptr conn );
     void unregister_connection( connection_ptr conn );
     
+    /// called by Connection::set_name, keeps the name index up to date
+    void rename_connection( Connection * conn, const std::string& name );
+    
+private:
+    typedef std::list< connection_ptr > conn_list;
+    
+    /// all connections, in the order they registered:
+    conn_list m_connections;
+    /// identity index into m_connections:
+    boost::unordered_map< Connection*, conn_list::iterator > m_conn_index;
+    /// name index into m_connections, unnamed connections are left out:
+    boost::unordered_multimap< std::string, conn_list::iterator > m_name_index;
+    boost::mutex m_connections_mutex; // protects connections and indexes
+    /// signalled when a connection (un)registers or has been torn down,
+    /// stop() waits on it
+    boost::condition_variable m_connections_cond;
+    boost::uint64_t m_registered;       // registrations ever
+    /// threads in connection_terminated, one entry per call
+    std::vector< boost::thread::id > m_terminating;
+    /// published with boost::atomic_load/store, null when stale.
+    /// only (re)built under m_connections_mutex.
+    conn_snapshot_ptr m_snapshot;
     
-    /// all connections:
-    std::vector< connection_ptr > m_connections;
-    boost::mutex m_connections_mutex; // protects connections
+    /// the acceptor's, used for everything if there's no io pool
+    boost::asio::io_service& acceptor_io_service();
+    /// the io_service for io slot slot
+    boost::asio::io_service& io_service( size_t slot );
+    
+    /// start n accept chains on a: each accept starts the next one when
+    /// it completes, until a is closed
+    void start_accepts( acceptor_ptr a, size_t slot, unsigned int n );
+    /// accept the next connection on a
+    void async_accept( acceptor_ptr a, size_t slot );
+    /// async_accept() on a's io_service, from a timer
+    void retry_accept( acceptor_ptr a, size_t slot );
+    /// one of a's chains gave up, a is closed after the last one
+    void end_accept_chain( acceptor_ptr a );
+    /// how long to back off when accept runs out of fds or memory
+    static const unsigned int accept_retry_ms = 100;
+    /// ask the Protocol about an accepted connection, on its strand
+    void admit( connection_ptr conn );
+    
+    /// remove conn from the name index, m_connections_mutex held
+    void unindex_name( Connection * conn );
+    /// a thread other than ours is in connection_terminated,
+    /// m_connections_mutex held
+    bool others_terminating() const;
+    
+    /// give conn the current writeq/capability settings. Done again on
+    /// accept, the pending connection may predate a settings change.
+    void apply_settings( connection_ptr conn );
+    
+    /// flood routing, returns false if the msg should be dropped
+    bool route_message( message_ptr msgp, connection_ptr from );
     
     /// The acceptor object used to accept incoming socket connections.
     boost::shared_ptr<boost::asio::ip::tcp::acceptor> m_acceptor;
+    /// more of them, see listen()
+    std::vector< acceptor_ptr > m_listeners;
+    /// accept chains outstanding per acceptor, see start_accepts()
+    boost::unordered_map< boost::asio::ip::tcp::acceptor*, unsigned int >
+        m_accept_chains;
+    boost::mutex m_accept_mutex;
+    boost::atomic<unsigned int> m_accept_retries; // chains backing off
+    
+    /// io_services connections are spread across, null if not in use
+    boost::scoped_ptr<IoServicePool> m_iopool;
+    
+    /// one per io_service, indexed by io slot
+    std::vector< timer_wheel_ptr > m_timers;
+    
+    boost::scoped_ptr<Broadcaster> m_broadcaster;
+    
+    Connection::priority m_type_priority[256];
+    bool m_datagram_type[256];
+    datagram_socket_ptr m_datagrams;    // null unless enabled
+    
+    /// writeq settings for new connections
+    Connection::writeq_policy m_writeq_policy;
+    size_t m_max_writeq_size;
+    unsigned int m_block_timeout_ms;
+    
+    boost::uint32_t m_caps; // offered on new connections
+    size_t m_compress_threshold;
+    int m_compress_level;
+    liveness m_liveness;    // given to new connections
+    
+    TokenBucket m_send_bucket;          // shared by all connections
+    boost::uint64_t m_conn_rate;        // given to new connections
+    boost::uint64_t m_conn_burst;
+    socket_options m_sockopts;          // given to new connections
+    
+    /// seen GUIDs, null unless flood routing is on
+    boost::scoped_ptr<GuidCache> m_seen;
+    boost::atomic<boost::uint64_t> m_forwarded, m_ttl_expired;
     
     /// protocol implementation
     Protocol * m_protocol;
-    /// thread that enforces flow-control and sends outgoing msgs
-    boost::thread m_dispatch_thread;
     
-    /// misc stats:
-    unsigned int seen_connections; // num incoming connections accepted
+    /// metrics, see router_metrics:
+    boost::atomic<boost::uint64_t> m_accepted, m_refused;
+    boost::atomic<boost::uint64_t> m_connected, m_connect_failed;
+    boost::atomic<boost::uint64_t> m_timed_out;
+    boost::atomic<boost::uint64_t> m_msgs_in[256], m_msgs_out[256];
     
     boost::function<std::string()> m_uuidgen;
 };
@@ -0,0 +1,47 @@
+#ifndef __LIBF2F_STREAM_H__
+#define __LIBF2F_STREAM_H__
+
+#include <boost/cstdint.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <istream>
+#include <string>
+
+namespace libf2f {
+
+/// Identifies a stream, in the namespace of the connection end that
+/// opened it. 0 is never a valid id.
+typedef boost::uint32_t stream_id;
+
+/// Where an outgoing stream's payload comes from. Fills buf with up to
+/// len bytes and returns how many, 0 at the end or -1 on error.
+/// Called on the connection's strand, so it shouldn't block for long.
+typedef boost::function<int( char * buf, size_t len )> stream_source;
+
+/// Called once an outgoing stream is over, true if all of it was sent
+typedef boost::function<void( bool )> stream_done_cb;
+
+/// length to give open_stream when it isn't known up front
+const boost::uint64_t unknown_stream_length = ~boost::uint64_t(0);
+
+/// Owns a file descriptor, it's closed when the last ref goes away
+class FileDescriptor : boost::noncopyable
+{
+public:
+    explicit FileDescriptor( int fd ) : m_fd( fd ) {}
+    ~FileDescriptor();
+    int fd() const { return m_fd; }
+private:
+    int m_fd;
+};
+typedef boost::shared_ptr<FileDescriptor> fd_ptr;
+
+stream_source source_from_string( boost::shared_ptr<const std::string> s );
+stream_source source_from_istream( boost::shared_ptr<std::istream> is );
+/// reads fd until EOF, closing it when the source goes away
+stream_source source_from_fd( int fd );
+
+} //ns
+
+#endif
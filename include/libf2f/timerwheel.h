@@ -0,0 +1,94 @@
+#ifndef __LIBF2F_TIMERWHEEL_H__
+#define __LIBF2F_TIMERWHEEL_H__
+
+#include <boost/asio.hpp>
+#include <boost/cstdint.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/function.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/unordered_map.hpp>
+#include <list>
+#include <vector>
+
+namespace libf2f {
+
+/// Hashed timer wheel: lots of timeouts on one deadline_timer. A timer
+/// lands in slot (expiry tick % slots) and every tick the current slot is
+/// checked, so adding and cancelling are O(1) and a tick only looks at
+/// the timers in one slot. Timers further out than a revolution stay in
+/// their slot until their tick comes round. Resolution is one tick, a
+/// timer fires up to a tick late, never early.
+/// The deadline_timer only runs while timers are pending, so an idle
+/// wheel costs nothing. Callbacks run on the io_service, not under the
+/// wheel's lock, so they may add or cancel timers. Thread safe.
+/// Create with create(), the tick handler holds a reference to it.
+class TimerWheel
+: public boost::enable_shared_from_this<TimerWheel>, boost::noncopyable
+{
+public:
+    typedef boost::uint64_t timer_id;   // never 0
+    typedef boost::function<void()> callback;
+    
+    static boost::shared_ptr<TimerWheel> create(
+                            boost::asio::io_service& ios,
+                            unsigned int tick_ms = default_tick_ms,
+                            size_t slots = default_slots );
+    
+    /// run cb once, ms from now
+    timer_id add( unsigned int ms, callback cb );
+    
+    /// false if it already fired or was cancelled. A callback that's
+    /// about to run when this is called may still run.
+    bool cancel( timer_id id );
+    
+    /// timers pending
+    size_t size();
+    
+    /// drop all timers without running them, add() does nothing after this
+    void stop();
+    
+    unsigned int tick_ms() const { return m_tick_ms; }
+    
+    static const unsigned int default_tick_ms = 10;
+    static const size_t default_slots = 1024;
+
+private:
+    TimerWheel( boost::asio::io_service& ios, unsigned int tick_ms,
+                size_t slots );
+    
+    struct entry
+    {
+        entry( timer_id i, boost::uint64_t d, const callback& c )
+            : id( i ), due( d ), cb( c ) {}
+        
+        timer_id id;
+        boost::uint64_t due;            // tick it fires on
+        callback cb;
+    };
+    typedef std::list< entry > slot;
+    
+    /// ticks since construction, by the clock
+    boost::uint64_t current_tick() const;
+    /// start the deadline_timer for the next tick, m_mutex held
+    void schedule();
+    void handle_tick( const boost::system::error_code& e );
+    
+    boost::mutex m_mutex;               // protects everything below
+    boost::asio::deadline_timer m_timer;
+    std::vector< slot > m_slots;
+    boost::unordered_map< timer_id, std::pair< size_t, slot::iterator > > m_index;
+    unsigned int m_tick_ms;
+    boost::uint64_t m_epoch_us;         // now_us at construction
+    boost::uint64_t m_done_tick;        // slots up to this tick were run
+    timer_id m_next_id;
+    bool m_ticking;                     // m_timer is running
+    bool m_stopped;
+};
+
+typedef boost::shared_ptr<TimerWheel> timer_wheel_ptr;
+
+} //ns
+
+#endif
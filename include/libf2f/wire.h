@@ -0,0 +1,58 @@
+#ifndef __LIBF2F_WIRE_H__
+#define __LIBF2F_WIRE_H__
+
+#include "libf2f/message.h"
+
+namespace libf2f {
+
+/*
+    Wire format v2, used once both ends have negotiated it:
+
+        Bytes   Description
+        -------------------
+        0       Flags (see v2_flags)
+        1       Msg Type
+        [2-3]   TTL, Hops, only if V2_TTL_HOPS is set. Otherwise they are
+                taken to be 1 and 0, the values nearly everything uses.
+        ..      GUID, 16 bytes binary if V2_GUID_UUID is set, else the
+                36 bytes as in v1
+        ..      Payload Length, unsigned LEB128 varint, 1-5 bytes
+        [..]    Uncompressed Payload Length, varint, only if V2_COMPRESSED
+        ..      Payload
+
+    A V2_COMPRESSED payload is the next chunk of the connection's raw
+    deflate stream, ended with a sync flush. The stream carries on from
+    one compressed msg to the next, so later msgs reuse the dictionary.
+
+    A v1 GUID in canonical UUID form (8-4-4-4-12 hex digits, letters all
+    the same case) is packed to 16 bytes, anything else is sent as is.
+*/
+
+enum v2_flags
+{
+    V2_GUID_UUID  = 0x01,   // 16 byte binary GUID
+    V2_GUID_UPPER = 0x02,   // ..whose hex letters were upper case
+    V2_TTL_HOPS   = 0x04,   // ttl and hops follow the type
+    V2_COMPRESSED = 0x08    // payload is deflated
+};
+
+/// largest possible v2 header
+const size_t wire_v2_max_header = 1 + 1 + 2 + 36 + 5 + 5;
+
+/// writes the v2 header for h into out, which must have room for
+/// wire_v2_max_header bytes. returns bytes written.
+/// if zlen is non-zero the payload is sent compressed, as zlen bytes.
+size_t encode_header_v2( const message_header& h, char * out,
+                         boost::uint32_t zlen = 0 );
+
+/// decodes a v2 header from the len bytes at p into h. h.length is the
+/// uncompressed payload length, in network order as in v1. *zlen is set
+/// to the compressed length if the payload is compressed, else 0.
+/// returns the header size, 0 if len bytes don't hold the whole header
+/// yet, or -1 if it's malformed.
+int decode_header_v2( const char * p, size_t len, message_header& h,
+                      boost::uint32_t * zlen );
+
+} //ns
+
+#endif
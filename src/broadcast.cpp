@@ -0,0 +1,207 @@
+#include "libf2f/broadcast.h"
+#include "libf2f/router.h"
+
+#include <boost/bind.hpp>
+
+namespace libf2f {
+
+using namespace std;
+
+Broadcaster::Broadcaster( Router& r )
+    : m_router( r ),
+      m_next_start( 0 ),
+      m_ticking( false ),
+      m_tick_timer( 0 ),
+      m_guard( new tick_guard ),
+      m_max_queued( default_max_queued ),
+      m_max_backlog( default_max_backlog ),
+      m_quantum( default_quantum )
+{
+    m_guard->self = this;
+}
+
+Broadcaster::~Broadcaster()
+{
+    {
+        // waits for a tick that's already running:
+        boost::mutex::scoped_lock lk( m_guard->mutex );
+        m_guard->self = 0;
+    }
+    if( m_ticking ) m_router.timers().cancel( m_tick_timer );
+}
+
+void
+Broadcaster::set_limits( size_t max_queued, size_t max_backlog,
+                         size_t quantum )
+{
+    boost::recursive_mutex::scoped_lock lk( m_mutex );
+    m_max_queued = max_queued;
+    m_max_backlog = max_backlog ? max_backlog : 1;
+    m_quantum = quantum;
+}
+
+void
+Broadcaster::broadcast( message_ptr msgp, const std::string& key,
+                        const connection_ptr& except )
+{
+    Router::conn_snapshot_ptr conns = m_router.connections();
+    const size_t n = conns->size();
+    send_list sends;
+    sends.reserve( n );
+    boost::recursive_mutex::scoped_lock lk( m_mutex );
+    ++m_stats.broadcasts;
+    const size_t start = n ? m_next_start++ % n : 0;
+    for( size_t i = 0; i < n; ++i )
+    {
+        const connection_ptr& c = (*conns)[ ( start + i ) % n ];
+        if( c == except ) continue;
+        boost::unordered_map< Connection*, peer_list::iterator >::iterator
+            it = m_index.find( c.get() );
+        if( it == m_index.end() )
+        {
+            if( c->writeq_bytes() < m_max_queued )
+            {
+                sends.push_back( make_pair( c, msgp ) );
+                ++m_stats.direct;
+                continue;
+            }
+            m_behind.push_back( peer( c ) );
+            it = m_index.insert( make_pair( c.get(), --m_behind.end() ) ).first;
+        }
+        enqueue( *it->second, msgp, key );
+    }
+    if( !m_behind.empty() ) drain( sends );
+    flush( sends );
+}
+
+void
+Broadcaster::enqueue( peer& p, const message_ptr& msgp,
+                      const std::string& key )
+{
+    if( !key.empty() )
+    {
+        // skip the superseded copy, the new one goes at the back so the
+        // peer still sees broadcasts in the order they were made:
+        for( std::deque< pending >::iterator it = p.backlog.begin();
+             it != p.backlog.end(); ++it )
+        {
+            if( it->key == key && it->msg->type() == msgp->type() )
+            {
+                p.backlog.erase( it );
+                --m_stats.backlog;
+                ++m_stats.coalesced;
+                break;
+            }
+        }
+    }
+    if( p.backlog.size() >= m_max_backlog )
+    {
+        p.backlog.pop_front();
+        --m_stats.backlog;
+        ++m_stats.dropped;
+    }
+    p.backlog.push_back( pending( msgp, key ) );
+    ++m_stats.backlog;
+    ++m_stats.deferred;
+}
+
+void
+Broadcaster::drain( send_list& sends )
+{
+    for( size_t n = m_behind.size(); n; --n )
+    {
+        peer& p = m_behind.front();
+        size_t queued = p.conn->writeq_bytes();
+        // a peer whose writeq is still full doesn't bank quanta:
+        if( queued < m_max_queued ) p.deficit += m_quantum;
+        while( !p.backlog.empty() && queued < m_max_queued )
+        {
+            const size_t len = p.backlog.front().msg->total_length();
+            if( len > p.deficit ) break;
+            sends.push_back( make_pair( p.conn, p.backlog.front().msg ) );
+            p.deficit -= len;
+            queued += len;
+            p.backlog.pop_front();
+            --m_stats.backlog;
+        }
+        if( p.backlog.empty() )
+        {
+            // caught up, back to the fast path
+            m_index.erase( p.conn.get() );
+            m_behind.pop_front();
+        }
+        else
+        {
+            m_behind.splice( m_behind.end(), m_behind, m_behind.begin() );
+        }
+    }
+}
+
+void
+Broadcaster::flush( const send_list& sends )
+{
+    for( size_t i = 0; i < sends.size(); ++i )
+    {
+        if( sends[i].first->async_write( sends[i].second ) !=
+            Connection::WRITE_QUEUED )
+        {
+            ++m_stats.dropped;
+        }
+    }
+    if( !m_behind.empty() && !m_ticking )
+    {
+        m_ticking = true;
+        TimerWheel& w = m_router.timers();
+        m_tick_timer = w.add( w.tick_ms(), 
+                    boost::bind( &Broadcaster::tick_if_alive, m_guard ) );
+    }
+}
+
+void
+Broadcaster::tick_if_alive( boost::shared_ptr<tick_guard> g )
+{
+    boost::mutex::scoped_lock lk( g->mutex );
+    if( g->self ) g->self->tick();
+}
+
+void
+Broadcaster::tick()
+{
+    send_list sends;
+    boost::recursive_mutex::scoped_lock lk( m_mutex );
+    m_ticking = false;
+    drain( sends );
+    flush( sends );
+}
+
+void
+Broadcaster::remove( const connection_ptr& conn )
+{
+    boost::recursive_mutex::scoped_lock lk( m_mutex );
+    boost::unordered_map< Connection*, peer_list::iterator >::iterator
+        it = m_index.find( conn.get() );
+    if( it == m_index.end() ) return;
+    m_stats.backlog -= it->second->backlog.size();
+    m_behind.erase( it->second );
+    m_index.erase( it );
+}
+
+size_t
+Broadcaster::backlog( const connection_ptr& conn )
+{
+    boost::recursive_mutex::scoped_lock lk( m_mutex );
+    boost::unordered_map< Connection*, peer_list::iterator >::iterator
+        it = m_index.find( conn.get() );
+    return it == m_index.end() ? 0 : it->second->backlog.size();
+}
+
+broadcast_stats
+Broadcaster::stats()
+{
+    boost::recursive_mutex::scoped_lock lk( m_mutex );
+    broadcast_stats st = m_stats;
+    st.peers_behind = m_behind.size();
+    return st;
+}
+
+} //ns
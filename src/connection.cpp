@@ -1,25 +1,96 @@
 #include "libf2f/connection.h"
 #include "libf2f/router.h"
+#include "libf2f/wire.h"
+#include "libf2f/log.h"
 #include <boost/foreach.hpp>
+#include <zlib.h>
+#include <unistd.h>
 
 namespace libf2f {
 
 using namespace std;
 
+
 Connection::Connection( boost::asio::io_service& io_service, Router * r )
     : m_socket(io_service), 
+      m_strand(io_service),
+      m_io_slot(0),
+      m_rxbuf_len(0),
+      m_rx_need(0),
+      m_starvation_limit(default_starvation_limit),
+      m_writeq_size(0),
+      max_writeq_size(default_max_writeq_size),
+      m_writeq_policy(WRITEQ_REJECT),
+      m_block_timeout_ms(0),
+      m_blocked_writers(0),
+      m_writeq_lowat(default_max_writeq_size/4),
+      m_writeq_hiwat(default_max_writeq_size/4*3),
+      m_writeq_high(false),
+      m_batch_max_bytes(default_batch_bytes),
+      m_batch_max_buffers(default_batch_buffers),
+      m_write_started(0),
+      m_throttled(false),
+      m_cork_batch(false),
+      m_corked(false),
+      m_msgs_in(0),
+      m_bytes_in(0),
+      m_caps(0),
+      m_peer_caps(0),
+      m_rx_v2(false),
+      m_tx_v2(false),
+      m_tx_switch_caps(0),
+      m_tx_compress(false),
+      m_compress_threshold(default_compress_threshold),
+      m_compress_level(default_compress_level),
+      m_deflate(0),
+      m_inflate(0),
+      m_txz_used(0),
+      m_next_stream_id(0),
+      m_num_sinks(0),
+      m_sendfile_done(0),
+      m_splice_id(0),
+      m_splice_left(0),
+      m_num_requests(0),
+      m_liveness_timer(0),
+      m_last_rx(0),
+      m_last_tx(0),
+      m_last_msg(0),
+      m_ping_seq(0),
+      m_ping_sent(0),
+      m_last_ping(0),
+      m_ping_unanswered(0),
+      m_srtt_us(0),
+      m_dgram_token(0),
+      m_dgram_probed(false),
+      m_dgram_peer_token(0),
+      m_dgram_up(false),
       m_ready(false),
       m_sending(false),
       m_shuttingdown(false),
       m_router(r)
 {
-    std::cout << "CTOR connection" << std::endl;
-    max_writeq_size = 20*1024; // 20kb
+    m_pipe[0] = m_pipe[1] = -1;
+    F2F_DEBUG( "CTOR connection" );
 }
 
 Connection::~Connection()
 {
-    std::cout << "dtor Connection shutting down" << std::endl;
+    F2F_DEBUG( "dtor Connection shutting down" );
+    if( m_deflate )
+    {
+        deflateEnd( m_deflate );
+        delete m_deflate;
+    }
+    if( m_inflate )
+    {
+        inflateEnd( m_inflate );
+        delete m_inflate;
+    }
+    if( m_pipe[0] >= 0 )
+    {
+        ::close( m_pipe[0] );
+        ::close( m_pipe[1] );
+    }
 }
 
 void 
@@ -31,14 +102,186 @@ Connection::close()
 
 void 
 Connection::fin()
+{
+    if( !m_strand.running_in_this_thread() )
+    {
+        m_strand.dispatch( boost::bind( &Connection::fin, shared_from_this() ) );
+        return;
+    }
+    fin_inline();
+}
+
+void
+Connection::fin_inline()
 {
     if( m_shuttingdown ) return;
     m_shuttingdown = true;
-    std::cout << "FIN connection " << str() << std::endl;
+    F2F_DEBUG( "FIN connection " << str() );
+    close_streams();
+    abort_requests();
+    if( m_liveness_timer )
+        m_router->timers( m_io_slot ).cancel( m_liveness_timer );
+    m_dgram_up.store( false );
+    if( m_dgram_token ) m_router->datagrams()->remove( m_dgram_token );
+    {
+        // wake anyone blocked in async_write:
+        boost::mutex::scoped_lock lk(m_mutex);
+        if( m_blocked_writers ) m_writeq_cond.notify_all();
+    }
     m_router->connection_terminated( shared_from_this() );
     close();
 }
 
+void
+Connection::start()
+{
+    if( !m_strand.running_in_this_thread() )
+    {
+        m_strand.dispatch( boost::bind( &Connection::start, shared_from_this() ) );
+        return;
+    }
+    apply_socket_options();
+    if( m_caps ) send_control( CTRL_HELLO, m_caps, false );
+    m_last_rx = m_last_tx = m_last_msg = now_us();
+    schedule_liveness();
+    async_read();
+}
+
+void
+Connection::set_socket_options( const socket_options& o )
+{
+    m_sockopts = o;
+    if( m_socket.is_open() ) apply_socket_options();
+}
+
+/// Writes are already coalesced into batches, so by default Nagle is off:
+/// it would only delay small latency sensitive msgs such as stream window
+/// updates. Failures are ignored, the OS defaults still work.
+void
+Connection::apply_socket_options()
+{
+    using boost::asio::ip::tcp;
+    const socket_options& o = m_sockopts;
+    boost::system::error_code ec;
+    m_socket.set_option( tcp::no_delay( o.mode != socket_options::SEND_NAGLE ),
+                         ec );
+    if( o.sndbuf )
+        m_socket.set_option( tcp::socket::send_buffer_size( o.sndbuf ), ec );
+    if( o.rcvbuf )
+        m_socket.set_option( tcp::socket::receive_buffer_size( o.rcvbuf ), ec );
+    if( o.mode != socket_options::SEND_ADAPTIVE ) set_cork( false );
+}
+
+void
+Connection::set_cork( bool on )
+{
+#ifdef TCP_CORK
+    if( on == m_corked ) return;
+    typedef boost::asio::detail::socket_option::boolean< 
+                                    IPPROTO_TCP, TCP_CORK > cork;
+    // uncorking pushes out whatever partial segment was held back:
+    boost::system::error_code ec;
+    m_socket.set_option( cork( on ), ec );
+    m_corked = on && !ec;
+#endif
+}
+
+void
+Connection::set_compression( size_t threshold, int level )
+{
+    m_compress_threshold = threshold;
+    m_compress_level = level;
+}
+
+void
+Connection::send_control( char subtype, boost::uint32_t caps, bool switch_tx,
+                          bool datagram )
+{
+    string body( 5, '\0' );
+    body[0] = subtype;
+    const boost::uint32_t ncaps = htonl( caps );
+    memcpy( &body[1], &ncaps, 4 );
+    message_ptr msgp( new GeneralMessage( control_msg_type, body, 
+                                          m_router->gen_uuid() ) );
+    if( datagram && m_dgram_up.load() && send_datagram( msgp ) ) return;
+    if( switch_tx )
+    {
+        boost::mutex::scoped_lock lk(m_mutex);
+        m_tx_switch = msgp;
+        m_tx_switch_caps = caps;
+    }
+    async_write( msgp, PRIO_HIGH );
+}
+
+void
+Connection::handle_control( message_ptr msgp )
+{
+    if( msgp->length() < 5 )
+    {
+        F2F_WARN( "Short control msg from " << str() );
+        return;
+    }
+    const char * p = msgp->payload();
+    if( p[0] >= CTRL_STREAM_OPEN && p[0] <= CTRL_STREAM_WINDOW )
+    {
+        handle_stream_control( msgp );
+        return;
+    }
+    boost::uint32_t caps;
+    memcpy( &caps, p + 1, 4 );
+    caps = ntohl( caps );
+    switch( p[0] )
+    {
+        case CTRL_HELLO:
+        {
+            m_peer_caps = caps;
+            boost::uint32_t common = m_caps & caps;
+            // there's no flag for it in v1 framing:
+            if( !( common & CAP_WIRE_V2 ) ) common &= ~CAP_COMPRESS;
+            // our ACK is the last msg we send without them:
+            if( common ) send_control( CTRL_ACK, common, true );
+            if( common & CAP_DATAGRAM ) offer_datagrams();
+            break;
+        }
+        case CTRL_ACK:
+            // everything after this msg uses what the peer acked:
+            if( caps & CAP_WIRE_V2 ) m_rx_v2 = true;
+            break;
+        
+        case CTRL_PING:
+            send_control( CTRL_PONG, caps, false, true );
+            break;
+        
+        case CTRL_PONG:
+            handle_pong( caps );
+            break;
+        
+        case CTRL_DGRAM_OFFER:
+            handle_datagram_offer( msgp );
+            break;
+        
+        case CTRL_DGRAM_PROBE:
+            // the peer's datagrams get through, tell it so (over TCP):
+            if( m_dgram_token && !m_dgram_probed )
+            {
+                m_dgram_probed = true;
+                send_control( CTRL_DGRAM_OK, 0, false );
+            }
+            break;
+        
+        case CTRL_DGRAM_OK:
+            if( m_dgram_peer_token && !m_dgram_up.load() )
+            {
+                F2F_DEBUG( "Datagrams up for " << str() );
+                m_dgram_up.store( true );
+            }
+            break;
+        
+        default: // from a newer peer, ignore
+            break;
+    }
+}
+
 /// Get the underlying socket.
 boost::asio::ip::tcp::socket& 
 Connection::socket()
@@ -46,90 +289,431 @@ Connection::socket()
     return m_socket;
 }
 
-void 
+Connection::write_result
 Connection::async_write(message_ptr msg)
 {
+    return async_write( msg, m_router->type_priority( msg->type() ) );
+}
+
+Connection::write_result
+Connection::async_write(message_ptr msg, priority prio)
+{
+    // these skip the writeq, if the peer takes datagrams and it fits:
+    if( m_dgram_up.load() && m_router->datagram_type( msg->type() ) &&
+        send_datagram( msg ) )
+    {
+        return WRITE_QUEUED;
+    }
+    return queue_write( msg, prio, true );
+}
+
+Connection::write_result
+Connection::queue_write( message_ptr msg, priority prio, bool limited )
+{
+    const size_t len = msg->total_length();
+    bool idle, high = false;
+    {
+        boost::mutex::scoped_lock lk(m_mutex);
+        write_result r = WRITE_QUEUED;
+        if( limited && prio != PRIO_HIGH &&
+            m_writeq_size && m_writeq_size + len > max_writeq_size )
+        {
+            r = make_room( lk, len );
+        }
+        if( r == WRITE_QUEUED )
+        {
+            const boost::uint64_t t = now_us();
+            m_lanes[prio].q.push_back( 
+                queued( msg, t, limited && msg != m_tx_switch ) );
+            if( m_liveness.idle_ms && msg->type() != control_msg_type )
+                m_last_msg.store( t, boost::memory_order_relaxed );
+            m_lanes[prio].bytes += len;
+            m_writeq_size += len;
+        }
+        // a refused msg means we're full, whatever the watermark is:
+        if( !m_writeq_high && 
+            ( m_writeq_size >= m_writeq_hiwat || r != WRITE_QUEUED ) )
+        {
+            m_writeq_high = high = true;
+        }
+        if( r != WRITE_QUEUED )
+        {
+            lk.unlock();
+            if( high ) fire_watermark( true );
+            return r;
+        }
+        idle = !m_sending;
+    }
+    if( high ) fire_watermark( true );
+    // make sure our sending loop is running, unless a write is in progress
+    // in which case handle_write will pick this msg up:
+    if( idle )
+    {
+        m_strand.dispatch( boost::bind( &Connection::do_async_write, 
+                                        shared_from_this() ) );
+    }
+    return WRITE_QUEUED;
+}
+
+Connection::write_result
+Connection::make_room( boost::mutex::scoped_lock& lk, size_t len )
+{
+    switch( m_writeq_policy )
+    {
+        case WRITEQ_UNBOUNDED:
+            return WRITE_QUEUED;
+        
+        case WRITEQ_DROP_OLDEST:
+            // lowest priority lane goes first. What can't be dropped
+            // still counts against the limit:
+            for( int i = num_priorities - 1; 
+                 i >= 0 && m_writeq_size + len > max_writeq_size; --i )
+            {
+                lane& l = m_lanes[i];
+                std::deque< queued >::iterator it = l.q.begin();
+                while( it != l.q.end() && 
+                       m_writeq_size + len > max_writeq_size )
+                {
+                    if( !it->evictable )
+                    {
+                        ++it;
+                        continue;
+                    }
+                    const size_t dlen = it->msg->total_length();
+                    l.bytes -= dlen;
+                    m_writeq_size -= dlen;
+                    it = l.q.erase( it );
+                    ++m_write_stats.dropped;
+                }
+            }
+            return WRITE_QUEUED;
+        
+        case WRITEQ_DROP_NEWEST:
+            ++m_write_stats.dropped;
+            return WRITE_DROPPED;
+        
+        case WRITEQ_BLOCK:
+        {
+            // blocking here would stop the writeq ever draining:
+            if( m_strand.running_in_this_thread() ) break;
+            boost::system_time deadline = boost::get_system_time() + 
+                            boost::posix_time::milliseconds( m_block_timeout_ms );
+            ++m_blocked_writers;
+            while( !m_shuttingdown && m_writeq_size &&
+                   m_writeq_size + len > max_writeq_size )
+            {
+                if( !m_writeq_cond.timed_wait( lk, deadline ) ) break;
+            }
+            --m_blocked_writers;
+            if( !m_writeq_size || m_writeq_size + len <= max_writeq_size )
+                return WRITE_QUEUED;
+            ++m_write_stats.rejected;
+            return WRITE_TIMEOUT;
+        }
+        
+        case WRITEQ_REJECT:
+            break;
+    }
+    ++m_write_stats.rejected;
+    return WRITE_REJECTED;
+}
+
+bool
+Connection::crossed_low_watermark()
+{
+    if( m_blocked_writers ) m_writeq_cond.notify_all();
+    if( m_writeq_high && m_writeq_size <= m_writeq_lowat )
+    {
+        m_writeq_high = false;
+        return true;
+    }
+    return false;
+}
+
+void
+Connection::fire_watermark( bool high )
+{
+    m_strand.dispatch( boost::bind( &Router::writeq_watermark, m_router,
+                                    shared_from_this(), high ) );
+}
+
+void
+Connection::set_writeq_policy( writeq_policy p, size_t max_bytes, 
+                               unsigned int block_timeout_ms )
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    m_writeq_policy = p;
+    max_writeq_size = max_bytes;
+    m_block_timeout_ms = block_timeout_ms;
+    m_writeq_hiwat = max_bytes / 4 * 3;
+    m_writeq_lowat = max_bytes / 4;
+}
+
+void
+Connection::set_starvation_limit( unsigned int n )
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    m_starvation_limit = n;
+}
+
+size_t
+Connection::writeq_size() const
+{
+    size_t n = 0;
+    for( size_t i = 0; i < num_priorities; ++i ) n += m_lanes[i].q.size();
+    return n;
+}
+
+void
+Connection::set_writeq_watermarks( size_t low, size_t high )
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    m_writeq_lowat = low;
+    m_writeq_hiwat = high;
+}
+
+void
+Connection::set_write_coalescing( size_t max_bytes, size_t max_buffers )
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    m_batch_max_bytes = max_bytes;
+    m_batch_max_buffers = max_buffers;
+}
+
+write_stats
+Connection::get_write_stats()
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    return m_write_stats;
+}
+
+connection_metrics
+Connection::get_metrics()
+{
+    connection_metrics m;
     {
         boost::mutex::scoped_lock lk(m_mutex);
-        m_writeq.push_back(msg);
-        m_writeq_size += msg->total_length();
+        m.msgs_out = m_write_stats.messages;
+        m.bytes_out = m_write_stats.bytes;
+        m.dropped = m_write_stats.dropped;
+        m.rejected = m_write_stats.rejected;
+        m.writeq_bytes = m_writeq_size;
+        for( size_t i = 0; i < num_priorities; ++i ) 
+            m.writeq_msgs += m_lanes[i].q.size();
     }
-    // make sure our sending loop is running:
-    boost::system::error_code e;
-    do_async_write( e, message_ptr() );
+    m.msgs_in = m_msgs_in.load( boost::memory_order_relaxed );
+    m.bytes_in = m_bytes_in.load( boost::memory_order_relaxed );
+    m.write_latency = m_write_latency.snapshot();
+    m.queue_wait = m_queue_wait.snapshot();
+    m.rtt_us = m_srtt_us.load( boost::memory_order_relaxed );
+    m.rtt = m_rtt.snapshot();
+    return m;
 }
 
-/// Reading incoming messages is a chain of 3 async methods:
-/// async_read() -> handle_read_headers() -> handle_read_data()
+/// Reading incoming messages is a loop of async_read() -> handle_read().
+/// Each read takes as much as the socket has, then every complete message
+/// in the buffer is dispatched; a trailing partial message is kept for the
+/// next read.
 void 
 Connection::async_read()
 {
     if( m_shuttingdown ) return;
-    message_ptr msgp(new Message());
-    // Read exactly the number of bytes in a header
-    boost::asio::async_read(m_socket, 
-                            boost::asio::buffer((char*)&msgp->header(), 
-                                                sizeof(message_header)),
-                            boost::bind(&Connection::handle_read_header,
-                                        shared_from_this(), 
-                                        boost::asio::placeholders::error, 
-                                        msgp
-                                        ));
-}
-/// called when we've read the header off the wire
+    // allocated on first read, so pending accepts don't hold one:
+    if( m_rxbuf.empty() ) m_rxbuf.resize( rx_buffer_size );
+    size_t len = m_rxbuf.size() - m_rxbuf_len;
+#ifdef __linux__
+    // leave payloads of sinking streams in the socket, to be spliced. We
+    // can read up to where the next msg's header might be one:
+    if( m_num_sinks ) len = std::min( len, m_rx_need + sink_read_size );
+#endif
+    m_socket.async_read_some(
+                    boost::asio::buffer(&m_rxbuf[m_rxbuf_len], len),
+                    m_strand.wrap(
+                    boost::bind(&Connection::handle_read,
+                                shared_from_this(), 
+                                boost::asio::placeholders::error, 
+                                boost::asio::placeholders::bytes_transferred
+                                )));
+}
+
+/// called when some bytes have been read off the wire
 void 
-Connection::handle_read_header(const boost::system::error_code& e, message_ptr msgp)
+Connection::handle_read(const boost::system::error_code& e, std::size_t bytes)
 {
-    //cout << "handle_read_header" << endl;
     if( m_shuttingdown ) return;
     if (e)
     {
-        std::cerr << "err " << e.value() << " handle_read_header: " 
-                  << e.message() << std::endl;
+        if( e == boost::asio::error::eof )
+            F2F_DEBUG( "handle_read: peer closed " << str() );
+        else
+            F2F_WARN( "err " << e.value() << " handle_read: " << e.message() );
         fin();
         return;
     }
-    // Start an asynchronous call to receive the payload data
-    assert( msgp->length() <= 16384 ); // 10K hard limit on payload size 
-    // allocate space for payload, length taken from header:
-    msgp->malloc_payload();
-    // short-circuit if there is no payload
-    if( msgp->length() == 0 )
+    m_rxbuf_len += bytes;
+    m_bytes_in.fetch_add( bytes, boost::memory_order_relaxed );
+    m_last_rx = now_us();
+    if( !dispatch_buffered() ) return;
+    // the rest of a sinking stream's fragment is still in the socket:
+    if( m_splice_left )
     {
-        handle_read_data( e, msgp );
+        continue_splice();
         return;
     }
-    // read the payload data:
-    boost::asio::async_read(m_socket, 
-                            boost::asio::buffer(msgp->payload(), 
-                                                msgp->length()),
-                            boost::bind(&Connection::handle_read_data,
-                                        shared_from_this(), 
-                                        boost::asio::placeholders::error,
-                                        msgp
-                                        ));
-    
+    // setup recv for next lot of data:
+    async_read();
+}
+
+int
+Connection::parse_header( const char * p, size_t len, message_header& h,
+                          boost::uint32_t * zlen )
+{
+    *zlen = 0;
+    if( m_rx_v2 ) return decode_header_v2( p, len, h, zlen );
+    if( len < sizeof(message_header) ) return 0;
+    memcpy( &h, p, sizeof(message_header) );
+    return sizeof(message_header);
+}
+
+bool
+Connection::dispatch_buffered()
+{
+    size_t off = 0;
+    m_rx_need = 0;
+    while( off < m_rxbuf_len )
+    {
+        message_header h;
+        boost::uint32_t zlen;
+        const int hlen = parse_header( &m_rxbuf[off], m_rxbuf_len - off, h,
+                                       &zlen );
+        if( hlen == 0 ) break; // partial header, wait for more
+        if( hlen < 0 )
+        {
+            F2F_WARN( "err malformed msg header, terminating " << str() );
+            fin();
+            return false;
+        }
+        const boost::uint32_t len = ntohl( h.length );
+        // what's on the wire, compressed payloads can be a bit bigger:
+        const boost::uint32_t wlen = zlen ? zlen : len;
+        if( len > max_payload_size || wlen > max_payload_size * 2 )
+        {
+            F2F_WARN( "err msg length " << len << " exceeds limit, "
+                      << "terminating " << str() );
+            fin();
+            return false;
+        }
+        if( zlen && !( m_caps & CAP_COMPRESS ) )
+        {
+            F2F_WARN( "err compressed msg wasn't negotiated, "
+                      << "terminating " << str() );
+            fin();
+            return false;
+        }
+        if( m_num_sinks && !zlen && h.type == control_msg_type &&
+            m_rxbuf_len - off >= size_t( hlen ) + 5 )
+        {
+            // data for a sinking stream is written out as it arrives
+            const size_t used = sink_fragment( off, hlen, len );
+            if( m_shuttingdown ) return false;
+            if( used )
+            {
+                m_msgs_in.fetch_add( 1, boost::memory_order_relaxed );
+                m_router->count_msg_in( h.type );
+                off += used;
+                if( m_splice_left ) break;
+                continue;
+            }
+        }
+        const size_t have = m_rxbuf_len - off;
+        if( have < hlen + wlen )
+        {
+            // partial, wait for more. Just enough to tell if it's
+            // sinking stream data, if it might be:
+            m_rx_need = m_num_sinks && !zlen && h.type == control_msg_type &&
+                        have < size_t( hlen ) + 5 ? hlen + 5 - have
+                                                  : hlen + wlen - have;
+            break;
+        }
+        
+        message_ptr msgp(new Message(h));
+        // allocate space for payload, length taken from header:
+        if( msgp->malloc_payload() )
+        {
+            if( !zlen )
+                memcpy( msgp->payload(), &m_rxbuf[off + hlen], len );
+            else if( !inflate_payload( &m_rxbuf[off + hlen], zlen, msgp ) )
+            {
+                F2F_WARN( "err bad compressed payload, terminating "
+                          << str() );
+                fin();
+                return false;
+            }
+        }
+        off += hlen + wlen;
+        m_msgs_in.fetch_add( 1, boost::memory_order_relaxed );
+        m_router->count_msg_in( h.type );
+        
+        dispatch_message( msgp );
+        if( m_shuttingdown ) return false;
+    }
+    // keep any partial message at the front of the buffer:
+    if( off )
+    {
+        m_rxbuf_len -= off;
+        if( m_rxbuf_len ) memmove( &m_rxbuf[0], &m_rxbuf[off], m_rxbuf_len );
+    }
+    return true;
+}
+
+bool
+Connection::inflate_payload( const char * p, size_t zlen, message_ptr msgp )
+{
+    if( !m_inflate )
+    {
+        m_inflate = new z_stream;
+        memset( m_inflate, 0, sizeof(z_stream) );
+        if( inflateInit2( m_inflate, -MAX_WBITS ) != Z_OK )
+        {
+            delete m_inflate;
+            m_inflate = 0;
+            return false;
+        }
+    }
+    m_inflate->next_in = (Bytef*)p;
+    m_inflate->avail_in = zlen;
+    m_inflate->next_out = (Bytef*)msgp->payload();
+    m_inflate->avail_out = msgp->length();
+    const int r = inflate( m_inflate, Z_SYNC_FLUSH );
+    // each msg is exactly one sync-flushed chunk of the stream:
+    return ( r == Z_OK || r == Z_BUF_ERROR ) &&
+           m_inflate->avail_in == 0 && m_inflate->avail_out == 0;
 }
-/// called when we've read header and payload off the wire
+
+/// called for each message we've read (header and payload) off the wire
 void 
-Connection::handle_read_data(const boost::system::error_code& e, message_ptr msgp)
+Connection::dispatch_message(message_ptr msgp)
 {
-    if( m_shuttingdown ) return;
-    if (e)
+    //cout << "connection::rcvd_msg: " << msgp->str() << endl;
+    if( msgp->type() == control_msg_type )
+    {
+        handle_control( msgp );
+        return;
+    }
+    if( m_liveness.idle_ms )
+        m_last_msg.store( now_us(), boost::memory_order_relaxed );
+    // a reply to one of our requests?
+    if( m_num_requests.load( boost::memory_order_relaxed ) &&
+        complete_request( request_key( msgp ), boost::system::error_code(), 
+                          msgp ) )
     {
-        std::cerr << "err " << e.value() << " handle_read_data: " 
-                  << e.message() << std::endl;
-        fin();
         return;
     }
-    //cout << "connection::rcvd_msg: " << msgp->str() << endl;
     // report that we received a new message
     if( m_message_received_cbs.empty() )
         m_router->message_received( msgp, shared_from_this() );
     else 
         m_message_received_cbs.back()( msgp, shared_from_this() );
-    // setup recv for next message:
-    async_read();
 }
 
 std::string 
@@ -150,47 +734,326 @@ Connection::str() const
     return os.str();
 }
 
-/// Calls to do_async_write are chained - it will call itself when a write
-/// completes, to send the next msg in the queue. Bails when none left.
+/// Calls to do_async_write are chained - handle_write will start the next
+/// batch when a write completes. Bails when none left.
 void 
-Connection::do_async_write(const boost::system::error_code& e, message_ptr finished_msg)
+Connection::do_async_write()
+{
+    if( m_shuttingdown ) return;
+    bool low;
+    { // mutex scope
+        boost::mutex::scoped_lock lk(m_mutex);
+        if( m_sending )
+        {
+            // this call is telling us to send, but we already are.
+            return;
+        }
+        if( !fill_write_batch() ) return;
+        m_sending = true;
+        low = crossed_low_watermark();
+    } // mutex scope
+    if( low ) fire_watermark( false );
+    
+    start_batch();
+}
+
+void
+Connection::handle_write(const boost::system::error_code& e, std::size_t bytes)
 {
     if( m_shuttingdown ) return;
     if( e )
     {
-        cerr << "Error in libf2f::do_async_write, terminating connection: " 
-             << e.value() << ", " << e.message() << endl;
+        F2F_WARN( "Error in libf2f::handle_write, terminating connection: " 
+                  << e.value() << ", " << e.message() );
         fin();
         return;
     }
-    message_ptr msgp;
-    { // mutex scope
-        boost::mutex::scoped_lock lk(m_mutex);
-        if(m_sending && !finished_msg)
+    m_last_tx = now_us();
+    if( m_sendfile )
+    {
+        // the batch ended with a msg header, its file part comes next:
         {
-            // this call is telling us to send, but we already are.
-            //cout << "bailing from do_async_write - already sending (sending=true)" << endl;
-            return;
+            boost::mutex::scoped_lock lk(m_mutex);
+            m_write_stats.bytes += bytes;
         }
-        
-        if(m_writeq.empty())
+        continue_sendfile();
+        return;
+    }
+    // includes the file part of a batch, if it had one:
+    m_write_latency.record( m_last_tx - m_write_started );
+    bool low;
+    { // mutex scope
+        boost::mutex::scoped_lock lk(m_mutex);
+        m_write_stats.bytes += bytes;
+        // releases our refs to the messages in the completed batch:
+        m_write_batch.clear();
+        m_write_bufs.clear();
+        if( !fill_write_batch() )
         {
-            //cout << "bailing from do_async_write, q empty (sending=false)" << endl;
+            //cout << "bailing from handle_write, q empty (sending=false)" << endl;
             m_sending = false;
+            lk.unlock();
+            // a new batch can only start on the strand, after this:
+            set_cork( false );
             return;
         }
-        
-        msgp = m_writeq.front();
-        m_writeq.pop_front();
-        m_writeq_size -= msgp->total_length();
-        m_sending = true;
+        low = crossed_low_watermark();
     } // mutex scope
+    if( low ) fire_watermark( false );
     
-    boost::asio::async_write( socket(), msgp->to_buffers(),
-                              boost::bind( &Connection::do_async_write, 
+    start_batch();
+}
+
+void
+Connection::start_batch()
+{
+    if( m_shuttingdown ) return;
+    // once per batch, a resumed one is already deflated:
+    deflate_batch();
+    TokenBucket& global = m_router->send_bucket();
+    if( m_send_bucket.limited() || global.limited() )
+    {
+        const boost::uint64_t us = std::max( m_send_bucket.delay(), 
+                                             global.delay() );
+        if( us )
+        {
+            m_throttled = true; // paused isn't stalled
+            // don't hold back the tail of the last batch while we wait:
+            set_cork( false );
+            {
+                boost::mutex::scoped_lock lk(m_mutex);
+                ++m_write_stats.throttled;
+            }
+            m_router->timers( m_io_slot ).add( unsigned( ( us + 999 ) / 1000 ),
+                boost::bind( &Connection::resume_batch,
+                             connection_ptr_weak( shared_from_this() ) ) );
+            return;
+        }
+        size_t len = boost::asio::buffer_size( m_write_bufs );
+        int fd;
+        boost::uint64_t off;
+        size_t flen;
+        if( m_sendfile && m_sendfile->file_region( &fd, &off, &flen ) ) 
+            len += flen;
+        m_send_bucket.consume( len );
+        global.consume( len );
+    }
+    m_throttled = false;
+    set_cork( m_cork_batch );
+    m_write_started = m_last_tx = now_us();
+    boost::asio::async_write( socket(), m_write_bufs,
+                              m_strand.wrap(
+                              boost::bind( &Connection::handle_write, 
                                            shared_from_this(),
                                            boost::asio::placeholders::error,
-                                           msgp ) );
+                                           boost::asio::placeholders::bytes_transferred ) ) );
+}
+
+void
+Connection::resume_batch( connection_ptr_weak conn )
+{
+    connection_ptr c = conn.lock();
+    if( c ) c->m_strand.dispatch( boost::bind( &Connection::start_batch, c ) );
+}
+
+/// Strict priority, except a lane that has been passed over too often
+/// goes first (lowest such lane, since it has waited longest).
+size_t
+Connection::pick_lane() const
+{
+    size_t best = num_priorities;
+    for( size_t i = 0; i < num_priorities; ++i )
+    {
+        if( m_lanes[i].q.empty() ) continue;
+        if( best == num_priorities ) best = i;
+        else if( m_lanes[i].passed_over >= m_starvation_limit ) best = i;
+    }
+    return best;
+}
+
+/// Drains messages from the writeq lanes until adding the next one
+/// would exceed the byte or buffer budget.
+bool
+Connection::fill_write_batch()
+{
+    size_t batch_bytes = 0;
+    size_t li;
+    bool high = false;
+    const boost::uint64_t t = now_us();
+    // room for a v2 header per msg. Can only grow while the batch is
+    // empty, the buffers point into it:
+    if( ( m_caps & CAP_WIRE_V2 ) &&
+        m_txhdr.size() < ( m_batch_max_buffers + 1 ) * wire_v2_max_header )
+    {
+        m_txhdr.resize( ( m_batch_max_buffers + 1 ) * wire_v2_max_header );
+    }
+    // likewise room for the batch's compressed payloads, at most
+    // batch_bytes of input unless it's a single msg:
+    m_txz_used = 0;
+    if( m_caps & CAP_COMPRESS )
+    {
+        const size_t need = compress_bound( std::max( m_batch_max_bytes, 
+                                    size_t(max_payload_size) ) ) +
+                            ( m_batch_max_buffers + 1 ) * 32;
+        if( m_txz.size() < need ) m_txz.resize( need );
+    }
+    while( (li = pick_lane()) != num_priorities )
+    {
+        lane& l = m_lanes[li];
+        const message_ptr& msgp = l.q.front().msg;
+        const size_t len = msgp->total_length();
+        int fd;
+        boost::uint64_t foff;
+        size_t flen;
+        const bool file = msgp->file_region( &fd, &foff, &flen );
+        const bool z = m_tx_compress && !file && msgp->length() &&
+                       msgp->length() >= m_compress_threshold;
+        if( !m_write_batch.empty() &&
+            ( batch_bytes + len > m_batch_max_bytes ||
+              ( z && ( m_write_bufs.size() + 2 > m_batch_max_buffers ||
+                       m_txz_used + compress_bound( msgp->length() ) > 
+                            m_txz.size() ) ) ) )
+        {
+            // doesn't fit, leave it for the next batch:
+            break;
+        }
+        if( z )
+        {
+            // deflated by deflate_batch() once m_mutex is released
+            reserve_compressed_buffers( msgp );
+        }
+        else
+        {
+            const size_t nbufs = append_write_buffers( msgp );
+            if( !m_write_batch.empty() && 
+                m_write_bufs.size() > m_batch_max_buffers )
+            {
+                m_write_bufs.resize( m_write_bufs.size() - nbufs );
+                break;
+            }
+        }
+        m_writeq_size -= len;
+        l.bytes -= len;
+        batch_bytes += len;
+        m_write_batch.push_back( msgp );
+        high = high || li == PRIO_HIGH;
+        if( msgp == m_tx_switch )
+        {
+            // the peer expects the negotiated caps from the next msg on
+            m_tx_v2 = ( m_tx_switch_caps & CAP_WIRE_V2 ) != 0;
+            m_tx_compress = ( m_tx_switch_caps & CAP_COMPRESS ) != 0;
+            m_tx_switch.reset();
+        }
+        if( file )
+        {
+            m_sendfile = msgp;
+            m_sendfile_done = 0;
+        }
+        m_queue_wait.record( t - l.q.front().since );
+        m_router->count_msg_out( msgp->type() );
+        l.q.pop_front();
+        l.passed_over = 0;
+        for( size_t i = li + 1; i < num_priorities; ++i )
+        {
+            if( !m_lanes[i].q.empty() ) ++m_lanes[i].passed_over;
+        }
+        // the file part is sent once this batch has been written:
+        if( file ) break;
+    }
+    if( m_write_batch.empty() ) return false;
+    
+    // cork only if another batch follows straight away to fill the
+    // segment this one ends with:
+    m_cork_batch = m_sockopts.mode == socket_options::SEND_ADAPTIVE &&
+                   m_writeq_size && !high;
+    if( m_cork_batch ) ++m_write_stats.corked;
+    ++m_write_stats.batches;
+    m_write_stats.messages += m_write_batch.size();
+    if( m_write_batch.size() > m_write_stats.max_batch_messages )
+        m_write_stats.max_batch_messages = m_write_batch.size();
+    return true;
+}
+
+size_t
+Connection::append_write_buffers( const message_ptr& msgp )
+{
+    if( !m_tx_v2 ) return msgp->append_buffers( m_write_bufs );
+    char * hdr = &m_txhdr[ m_write_batch.size() * wire_v2_max_header ];
+    const size_t hlen = encode_header_v2( msgp->header(), hdr );
+    m_write_bufs.push_back( boost::asio::buffer( hdr, hlen ) );
+    return 1 + msgp->append_payload_buffers( m_write_bufs );
+}
+
+size_t
+Connection::compress_bound( size_t len ) const
+{
+    // deflateBound for a raw stream, plus the sync flush marker:
+    return len + (len >> 12) + (len >> 14) + (len >> 25) + 7 + 6;
+}
+
+void
+Connection::reserve_compressed_buffers( const message_ptr& msgp )
+{
+    pending_deflate p;
+    p.buf = m_write_bufs.size();
+    p.msg = m_write_batch.size();
+    p.zoff = m_txz_used;
+    m_deflate_pending.push_back( p );
+    m_txz_used += compress_bound( msgp->length() );
+    // header and payload, filled in by deflate_batch():
+    m_write_bufs.push_back( boost::asio::const_buffer() );
+    m_write_bufs.push_back( boost::asio::const_buffer() );
+}
+
+void
+Connection::deflate_batch()
+{
+    if( m_deflate_pending.empty() ) return;
+    if( !m_deflate )
+    {
+        m_deflate = new z_stream;
+        memset( m_deflate, 0, sizeof(z_stream) );
+        // can't fail short of out of memory, which we don't handle anyway:
+        deflateInit2( m_deflate, m_compress_level, Z_DEFLATED, -MAX_WBITS,
+                      8, Z_DEFAULT_STRATEGY );
+    }
+    boost::uint64_t in = 0, out = 0;
+    for( size_t i = 0; i < m_deflate_pending.size(); ++i )
+    {
+        const pending_deflate& p = m_deflate_pending[i];
+        const message_ptr& msgp = m_write_batch[ p.msg ];
+        m_zin.clear();
+        msgp->append_payload_buffers( m_zin );
+        char * z = &m_txz[ p.zoff ];
+        m_deflate->next_out = (Bytef*)z;
+        m_deflate->avail_out = compress_bound( msgp->length() );
+        for( size_t j = 0; j < m_zin.size(); ++j )
+        {
+            m_deflate->next_in = (Bytef*)boost::asio::buffer_cast<const char*>( m_zin[j] );
+            m_deflate->avail_in = boost::asio::buffer_size( m_zin[j] );
+            deflate( m_deflate, Z_NO_FLUSH );
+        }
+        deflate( m_deflate, Z_SYNC_FLUSH );
+        const size_t zlen = (char*)m_deflate->next_out - z;
+        in += msgp->length();
+        out += zlen;
+        
+        char * hdr = &m_txhdr[ p.msg * wire_v2_max_header ];
+        const size_t hlen = encode_header_v2( msgp->header(), hdr, zlen );
+        m_write_bufs[ p.buf ] = boost::asio::buffer( hdr, hlen );
+        m_write_bufs[ p.buf + 1 ] = boost::asio::buffer( z, zlen );
+    }
+    boost::mutex::scoped_lock lk(m_mutex);
+    m_write_stats.compressed += m_deflate_pending.size();
+    m_write_stats.compressed_in += in;
+    m_write_stats.compressed_out += out;
+    m_deflate_pending.clear();
+}
+
+void
+Connection::set_name( const std::string& n )
+{
+    m_router->rename_connection( this, n );
 }
 
 void
@@ -0,0 +1,414 @@
+#include "libf2f/datagram.h"
+#include "libf2f/connection.h"
+#include "libf2f/router.h"
+#include "libf2f/metrics.h"
+#include "libf2f/wire.h"
+#include "libf2f/log.h"
+
+#include <boost/bind.hpp>
+#include <boost/version.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <sys/socket.h>
+
+namespace libf2f {
+
+using namespace std;
+using boost::asio::ip::udp;
+
+boost::shared_ptr<DatagramSocket>
+DatagramSocket::create( boost::asio::io_service& ios, const udp::endpoint& ep )
+{
+    return boost::shared_ptr<DatagramSocket>( new DatagramSocket( ios, ep ) );
+}
+
+DatagramSocket::DatagramSocket( boost::asio::io_service& ios,
+                                const udp::endpoint& ep )
+    : m_socket( ios, ep ),
+      m_strand( ios ),
+      m_queued( 0 ),
+      m_next_token( boost::uint32_t( now_us() ) * 2654435761u ),
+      m_stopped( false ),
+      m_rxbuf( batch_size * max_datagram_size )
+{
+    m_socket.non_blocking( true );
+    // a burst has to wait in the socket until the io thread gets to it,
+    // the OS may cap these:
+    boost::system::error_code ec;
+    m_socket.set_option( udp::socket::receive_buffer_size( socket_buffer_size ),
+                         ec );
+    m_socket.set_option( udp::socket::send_buffer_size( socket_buffer_size ),
+                         ec );
+}
+
+udp::endpoint
+DatagramSocket::local_endpoint() const
+{
+    return m_socket.local_endpoint();
+}
+
+void
+DatagramSocket::start()
+{
+    async_wait();
+}
+
+void
+DatagramSocket::stop()
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    m_stopped = true;
+    m_queued = 0;
+    m_peers.clear();
+    boost::system::error_code ec;
+    m_socket.close( ec );
+}
+
+boost::uint32_t
+DatagramSocket::add( const connection_ptr& conn,
+                     const boost::asio::ip::address& addr )
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    boost::uint32_t t;
+    do t = m_next_token++; while( !t || m_peers.count( t ) );
+    peer& p = m_peers[t];
+    p.conn = conn;
+    p.addr = addr;
+    return t;
+}
+
+void
+DatagramSocket::remove( boost::uint32_t token )
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    m_peers.erase( token );
+}
+
+datagram_stats
+DatagramSocket::stats()
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    return m_stats;
+}
+
+bool
+DatagramSocket::fits( const message_ptr& msgp )
+{
+    int fd;
+    boost::uint64_t off;
+    size_t flen;
+    return 4 + wire_v2_max_header + msgp->length() <= max_datagram_size &&
+           !msgp->file_region( &fd, &off, &flen );
+}
+
+bool
+DatagramSocket::send( const udp::endpoint& to, boost::uint32_t token,
+                      const message_ptr& msgp )
+{
+    if( !fits( msgp ) ) return false;
+    bool idle;
+    {
+        boost::mutex::scoped_lock lk( m_mutex );
+        if( m_stopped ) return true;
+        if( m_queued == max_queued )
+        {
+            ++m_stats.dropped;
+            return true;
+        }
+        if( m_queued == m_queue.size() ) m_queue.resize( m_queued + 1 );
+        outgoing& o = m_queue[m_queued];
+        o.to = to;
+        char * p = o.data.data();
+        const boost::uint32_t nt = htonl( token );
+        memcpy( p, &nt, 4 );
+        size_t len = 4 + encode_header_v2( msgp->header(), p + 4 );
+        m_scratch.clear();
+        msgp->append_payload_buffers( m_scratch );
+        for( size_t i = 0; i < m_scratch.size(); ++i )
+        {
+            const size_t n = boost::asio::buffer_size( m_scratch[i] );
+            memcpy( p + len,
+                    boost::asio::buffer_cast<const char*>( m_scratch[i] ), n );
+            len += n;
+        }
+        o.len = len;
+        idle = m_queued++ == 0;
+    }
+    // whatever is queued meanwhile goes in the same batch:
+    if( idle ) m_strand.post( boost::bind( &DatagramSocket::flush,
+                                           shared_from_this() ) );
+    return true;
+}
+
+void
+DatagramSocket::flush()
+{
+    size_t n;
+    {
+        boost::mutex::scoped_lock lk( m_mutex );
+        if( m_stopped ) return;
+        m_queue.swap( m_sending );
+        n = m_queued;
+        m_queued = 0;
+    }
+    size_t sent = 0, dropped = 0, calls = 0;
+    for( size_t done = 0; done < n; )
+    {
+        const size_t want = std::min( n - done, size_t(batch_size) );
+        const size_t k = send_batch( &m_sending[done], want );
+        ++calls;
+        sent += k;
+        done += k;
+        if( k ) continue;
+        // the socket buffer is full, or that one datagram was refused:
+        if( errno == EAGAIN || errno == EWOULDBLOCK )
+        {
+            dropped += n - done;
+            break;
+        }
+        ++dropped;
+        ++done;
+    }
+    boost::mutex::scoped_lock lk( m_mutex );
+    m_stats.sent += sent;
+    m_stats.dropped += dropped;
+    m_stats.send_calls += calls;
+}
+
+size_t
+DatagramSocket::send_batch( const outgoing * q, size_t n )
+{
+    const int fd = m_socket.native_handle();
+#ifdef __linux__
+    mmsghdr msgs[batch_size];
+    iovec iov[batch_size];
+    memset( msgs, 0, sizeof(msgs) );
+    for( size_t i = 0; i < n; ++i )
+    {
+        iov[i].iov_base = (void*)q[i].data.data();
+        iov[i].iov_len = q[i].len;
+        msgs[i].msg_hdr.msg_name = (void*)q[i].to.data();
+        msgs[i].msg_hdr.msg_namelen = q[i].to.size();
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    int r;
+    do r = ::sendmmsg( fd, msgs, n, MSG_DONTWAIT );
+    while( r < 0 && errno == EINTR );
+    return r < 0 ? 0 : size_t( r );
+#else
+    size_t i = 0;
+    for( ; i < n; ++i )
+    {
+        if( ::sendto( fd, q[i].data.data(), q[i].len, 0, q[i].to.data(),
+                      q[i].to.size() ) < 0 )
+        {
+            break;
+        }
+    }
+    return i;
+#endif
+}
+
+void
+DatagramSocket::async_wait()
+{
+#if BOOST_VERSION >= 106600
+    m_socket.async_wait( udp::socket::wait_read,
+                         boost::bind( &DatagramSocket::handle_readable,
+                                      shared_from_this(),
+                                      boost::asio::placeholders::error ) );
+#else
+    m_socket.async_receive( boost::asio::null_buffers(),
+                            boost::bind( &DatagramSocket::handle_readable,
+                                         shared_from_this(),
+                                         boost::asio::placeholders::error ) );
+#endif
+}
+
+void
+DatagramSocket::handle_readable( const boost::system::error_code& e )
+{
+    if( e )
+    {
+        if( e != boost::asio::error::operation_aborted )
+            F2F_ERROR( "Datagram socket failed: " << e.message() );
+        return;
+    }
+    receive();
+    async_wait();
+}
+
+void
+DatagramSocket::receive()
+{
+    const int fd = m_socket.native_handle();
+    udp::endpoint from[batch_size];
+    size_t got = 0, bad = 0, calls = 0;
+    for( ;; )
+    {
+        size_t lens[batch_size];
+        size_t r = 0;
+#ifdef __linux__
+        mmsghdr msgs[batch_size];
+        iovec iov[batch_size];
+        memset( msgs, 0, sizeof(msgs) );
+        for( size_t i = 0; i < batch_size; ++i )
+        {
+            iov[i].iov_base = &m_rxbuf[i * max_datagram_size];
+            iov[i].iov_len = max_datagram_size;
+            msgs[i].msg_hdr.msg_name = from[i].data();
+            msgs[i].msg_hdr.msg_namelen = from[i].capacity();
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        const int n = ::recvmmsg( fd, msgs, batch_size, MSG_DONTWAIT, 0 );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n > 0 ) r = size_t( n );
+        for( size_t i = 0; i < r; ++i )
+        {
+            from[i].resize( msgs[i].msg_hdr.msg_namelen );
+            // too big for us, so not ours:
+            lens[i] = ( msgs[i].msg_hdr.msg_flags & MSG_TRUNC ) ? 0
+                                                                : msgs[i].msg_len;
+        }
+#else
+        for( ; r < batch_size; ++r )
+        {
+            socklen_t alen = from[r].capacity();
+            const ssize_t n = ::recvfrom( fd, &m_rxbuf[r * max_datagram_size],
+                                          max_datagram_size, MSG_DONTWAIT,
+                                          from[r].data(), &alen );
+            if( n < 0 ) break;
+            from[r].resize( alen );
+            lens[r] = size_t( n );
+        }
+#endif
+        ++calls;
+        got += r;
+        for( size_t i = 0; i < r; ++i )
+        {
+            if( !deliver( &m_rxbuf[i * max_datagram_size], lens[i],
+                          from[i].address() ) )
+            {
+                ++bad;
+            }
+        }
+        // a short batch means we've emptied the socket:
+        if( r < batch_size ) break;
+    }
+    boost::mutex::scoped_lock lk( m_mutex );
+    m_stats.received += got;
+    m_stats.rejected += bad;
+    m_stats.recv_calls += calls;
+}
+
+bool
+DatagramSocket::deliver( const char * p, size_t len,
+                         const boost::asio::ip::address& from )
+{
+    if( len < 4 ) return false;
+    boost::uint32_t token;
+    memcpy( &token, p, 4 );
+    token = ntohl( token );
+    message_header h;
+    boost::uint32_t zlen;
+    const int hlen = decode_header_v2( p + 4, len - 4, h, &zlen );
+    if( hlen <= 0 || zlen || 4 + hlen + ntohl( h.length ) != len )
+        return false;
+    connection_ptr conn;
+    {
+        boost::mutex::scoped_lock lk( m_mutex );
+        boost::unordered_map< boost::uint32_t, peer >::const_iterator
+            it = m_peers.find( token );
+        if( it == m_peers.end() || it->second.addr != from ) return false;
+        conn = it->second.conn.lock();
+    }
+    if( !conn ) return false;
+    message_ptr msgp( new Message( h ) );
+    if( msgp->malloc_payload() )
+        memcpy( msgp->payload(), p + 4 + hlen, msgp->length() );
+    conn->strand().dispatch( boost::bind( &Connection::handle_datagram, conn,
+                                          msgp, len ) );
+    return true;
+}
+
+/// The side channel is set up over TCP once both ends have CAP_DATAGRAM:
+/// each side offers a token and port, the other probes it with datagrams
+/// and starts using it once told (over TCP) that a probe got through.
+/// Until then, or if they never do, everything goes over TCP.
+void
+Connection::offer_datagrams()
+{
+    DatagramSocket * d = m_router->datagrams();
+    boost::system::error_code ec;
+    const boost::asio::ip::address peer = m_socket.remote_endpoint( ec ).address();
+    if( !d || ec || m_dgram_token ) return;
+    m_dgram_token = d->add( shared_from_this(), peer );
+    string body( 7, '\0' );
+    body[0] = CTRL_DGRAM_OFFER;
+    const boost::uint32_t ntoken = htonl( m_dgram_token );
+    memcpy( &body[1], &ntoken, 4 );
+    const boost::uint16_t nport = htons( d->local_endpoint().port() );
+    memcpy( &body[5], &nport, 2 );
+    async_write( message_ptr( new GeneralMessage( control_msg_type, body,
+                                                  m_router->gen_uuid() ) ),
+                 PRIO_HIGH );
+}
+
+void
+Connection::handle_datagram_offer( message_ptr msgp )
+{
+    boost::system::error_code ec;
+    const boost::asio::ip::address peer = m_socket.remote_endpoint( ec ).address();
+    if( msgp->length() < 7 || ec || m_dgram_peer_token ||
+        !( m_caps & CAP_DATAGRAM ) || !m_router->datagrams() )
+    {
+        return;
+    }
+    boost::uint32_t token;
+    memcpy( &token, msgp->payload() + 1, 4 );
+    boost::uint16_t port;
+    memcpy( &port, msgp->payload() + 5, 2 );
+    if( !token ) return;
+    // the address we see the peer at, with the port it gave:
+    m_dgram_peer = udp::endpoint( peer, ntohs( port ) );
+    m_dgram_peer_token = ntohl( token );
+    string body( 5, '\0' );
+    body[0] = CTRL_DGRAM_PROBE;
+    message_ptr probe( new GeneralMessage( control_msg_type, body,
+                                           m_router->gen_uuid() ) );
+    // one is enough, a few in case of loss:
+    for( int i = 0; i < 3; ++i ) send_datagram( probe );
+}
+
+void
+Connection::handle_datagram( message_ptr msgp, size_t bytes )
+{
+    if( m_shuttingdown ) return;
+    if( msgp->type() == control_msg_type )
+    {
+        // the rest change the connection's state, they only come in order:
+        const char sub = msgp->length() ? msgp->payload()[0] : 0;
+        if( sub != CTRL_PING && sub != CTRL_PONG && sub != CTRL_DGRAM_PROBE )
+            return;
+    }
+    m_last_rx = now_us();
+    m_msgs_in.fetch_add( 1, boost::memory_order_relaxed );
+    m_bytes_in.fetch_add( bytes, boost::memory_order_relaxed );
+    m_router->count_msg_in( msgp->type() );
+    dispatch_message( msgp );
+}
+
+bool
+Connection::send_datagram( const message_ptr& msgp )
+{
+    if( !m_router->datagrams()->send( m_dgram_peer, m_dgram_peer_token, msgp ) )
+        return false;
+    m_router->count_msg_out( msgp->type() );
+    boost::mutex::scoped_lock lk(m_mutex);
+    ++m_write_stats.datagrams;
+    return true;
+}
+
+} //ns
@@ -0,0 +1,98 @@
+#include "libf2f/guidcache.h"
+
+#include <algorithm>
+
+namespace libf2f {
+
+using namespace std;
+
+GuidCache::GuidCache( size_t capacity, unsigned int max_age_ms )
+    : m_cur( 0 ),
+      m_count( 0 ),
+      m_capacity( capacity ? capacity : 1 ),
+      // a 0ms generation would be retired on every insert:
+      m_gen_age( boost::posix_time::milliseconds( 
+                                        std::max( max_age_ms / 2, 1u ) ) ),
+      m_gen_started( boost::get_system_time() )
+{
+    // keep the load factor at or under 1/2 so probes stay short:
+    size_t size = 1;
+    while( size < m_capacity * 2 ) size <<= 1;
+    m_mask = size - 1;
+    m_gen[0].resize( size, 0 );
+    m_gen[1].resize( size, 0 );
+}
+
+/// FNV-1a, never 0 since that marks an empty slot
+boost::uint64_t
+GuidCache::hash( const char * guid )
+{
+    boost::uint64_t h = 14695981039346656037ULL;
+    for( size_t i = 0; i < 36; ++i )
+    {
+        h ^= (unsigned char)guid[i];
+        h *= 1099511628211ULL;
+    }
+    return h ? h : 1;
+}
+
+bool
+GuidCache::find( const table& t, boost::uint64_t k, size_t * slot ) const
+{
+    size_t i = k & m_mask;
+    while( t[i] )
+    {
+        if( t[i] == k ) return true;
+        i = (i + 1) & m_mask;
+    }
+    if( slot ) *slot = i;
+    return false;
+}
+
+void
+GuidCache::rotate( const boost::system_time& now )
+{
+    m_cur ^= 1;
+    std::fill( m_gen[m_cur].begin(), m_gen[m_cur].end(), 0 );
+    m_count = 0;
+    m_gen_started = now;
+    ++m_stats.rotations;
+}
+
+bool
+GuidCache::check_and_insert( const char * guid )
+{
+    const boost::uint64_t k = hash( guid );
+    const boost::system_time now = boost::get_system_time();
+    boost::mutex::scoped_lock lk(m_mutex);
+    if( now - m_gen_started >= m_gen_age )
+    {
+        // both generations are past it if we've been idle that long:
+        if( now - m_gen_started >= m_gen_age * 2 ) rotate( now );
+        rotate( now );
+    }
+    size_t slot;
+    if( find( m_gen[m_cur], k, &slot ) || find( m_gen[m_cur^1], k, 0 ) )
+    {
+        ++m_stats.hits;
+        return true;
+    }
+    ++m_stats.misses;
+    if( m_count == m_capacity )
+    {
+        rotate( now );
+        find( m_gen[m_cur], k, &slot );
+    }
+    m_gen[m_cur][slot] = k;
+    ++m_count;
+    return false;
+}
+
+guid_cache_stats
+GuidCache::stats()
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    return m_stats;
+}
+
+} //ns
@@ -0,0 +1,73 @@
+#include "libf2f/iopool.h"
+
+#include <boost/bind.hpp>
+
+namespace libf2f {
+
+using namespace std;
+
+IoServicePool::IoServicePool( size_t n, policy p )
+    : m_next( 0 ),
+      m_policy( p )
+{
+    if( n == 0 ) n = boost::thread::hardware_concurrency();
+    if( n == 0 ) n = 1;
+    for( size_t i = 0; i < n; ++i )
+    {
+        boost::shared_ptr<boost::asio::io_service> ios( new boost::asio::io_service );
+        m_services.push_back( ios );
+        // keeps run() from returning while there are no connections:
+        m_work.push_back( boost::shared_ptr<boost::asio::io_service::work>(
+                            new boost::asio::io_service::work( *ios ) ) );
+        m_load.push_back( 0 );
+    }
+    for( size_t i = 0; i < n; ++i )
+    {
+        typedef size_t (boost::asio::io_service::*run_fn)();
+        m_threads.create_thread( boost::bind( (run_fn)&boost::asio::io_service::run,
+                                              m_services[i] ) );
+    }
+}
+
+IoServicePool::~IoServicePool()
+{
+    stop();
+}
+
+size_t
+IoServicePool::pick()
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    const size_t n = m_services.size();
+    size_t best = m_next;
+    if( m_policy == LEAST_LOADED )
+    {
+        for( size_t i = 1; i < n; ++i )
+        {
+            size_t j = (m_next + i) % n;
+            if( m_load[j] < m_load[best] ) best = j;
+        }
+    }
+    m_next = (best + 1) % n;
+    return best;
+}
+
+void
+IoServicePool::add_load( size_t i, int delta )
+{
+    boost::mutex::scoped_lock lk(m_mutex);
+    m_load[i] += delta;
+}
+
+void
+IoServicePool::stop()
+{
+    m_work.clear();
+    for( size_t i = 0; i < m_services.size(); ++i )
+    {
+        m_services[i]->stop();
+    }
+    m_threads.join_all();
+}
+
+} //ns
@@ -0,0 +1,145 @@
+#include "libf2f/connection.h"
+#include "libf2f/router.h"
+#include "libf2f/log.h"
+
+#include <boost/bind.hpp>
+#include <algorithm>
+
+namespace libf2f {
+
+using namespace std;
+
+namespace {
+
+const boost::uint64_t never = ~boost::uint64_t(0);
+
+/// when a limit of ms runs out, counting from t
+boost::uint64_t
+deadline( boost::uint64_t t, unsigned int ms )
+{
+    return ms ? t + boost::uint64_t( ms ) * 1000 : never;
+}
+
+} // anon ns
+
+/// One wheel timer per connection, armed for whichever limit runs out
+/// first. Activity doesn't touch the timer, it only moves the last_*
+/// times, so a busy connection costs one wakeup per limit period.
+void
+Connection::schedule_liveness()
+{
+    const liveness& l = m_liveness;
+    const boost::uint64_t now = now_us();
+    bool sending;
+    {
+        boost::mutex::scoped_lock lk(m_mutex);
+        sending = m_sending;
+    }
+    // waiting out a rate limit isn't stalling:
+    sending = sending && !m_throttled;
+    boost::uint64_t next = std::min( deadline( m_last_rx, l.read_timeout_ms ),
+                                     deadline( m_last_msg.load(), l.idle_ms ) );
+    if( l.write_timeout_ms )
+    {
+        // an idle writer can't stall, look again in a while:
+        next = std::min( next, deadline( sending ? m_last_tx : now,
+                                         l.write_timeout_ms ) );
+    }
+    if( l.keepalive_ms && ( m_caps & CAP_KEEPALIVE ) )
+    {
+        // until the handshake is done we don't know if the peer answers:
+        const bool ok = m_caps & m_peer_caps & CAP_KEEPALIVE;
+        if( !m_ping_sent || m_dgram_up.load() )
+            next = std::min( next, deadline( ok ? keepalive_from() : now,
+                                             l.keepalive_ms ) );
+        if( m_ping_unanswered )
+            next = std::min( next, deadline( m_ping_unanswered, 
+                                l.keepalive_ms * liveness::keepalive_misses ) );
+    }
+    if( next == never ) return;
+    const unsigned int ms = next > now ? unsigned( ( next - now + 999 ) / 1000 )
+                                       : 0;
+    m_liveness_timer = m_router->timers( m_io_slot ).add( ms,
+        boost::bind( &Connection::liveness_timer,
+                     connection_ptr_weak( shared_from_this() ) ) );
+}
+
+void
+Connection::liveness_timer( connection_ptr_weak conn )
+{
+    connection_ptr c = conn.lock();
+    if( c ) c->m_strand.dispatch( boost::bind( &Connection::check_liveness, c ) );
+}
+
+void
+Connection::check_liveness()
+{
+    m_liveness_timer = 0;
+    if( m_shuttingdown ) return;
+    const liveness& l = m_liveness;
+    const boost::uint64_t now = now_us();
+    bool sending;
+    {
+        boost::mutex::scoped_lock lk(m_mutex);
+        sending = m_sending;
+    }
+    sending = sending && !m_throttled;
+    const char * why = 0;
+    if( now >= deadline( m_last_rx, l.read_timeout_ms ) )
+        why = "nothing received";
+    else if( sending && now >= deadline( m_last_tx, l.write_timeout_ms ) )
+        why = "write stalled";
+    else if( m_ping_unanswered && l.keepalive_ms &&
+             now >= deadline( m_ping_unanswered, 
+                              l.keepalive_ms * liveness::keepalive_misses ) )
+        why = "pings unanswered";
+    if( why )
+    {
+        F2F_WARN( "Liveness: " << why << ", terminating " << str() );
+        m_router->count_timed_out();
+        fin();
+        return;
+    }
+    if( now >= deadline( m_last_msg.load(), l.idle_ms ) )
+    {
+        F2F_INFO( "Liveness: idle, terminating " << str() );
+        m_router->count_timed_out();
+        fin();
+        return;
+    }
+    // a ping that went as a datagram may be lost, so another is sent
+    // (and a late pong ignored) if it isn't answered in time:
+    if( ( m_caps & m_peer_caps & CAP_KEEPALIVE ) &&
+        ( !m_ping_sent || m_dgram_up.load() ) &&
+        now >= deadline( keepalive_from(), l.keepalive_ms ) )
+    {
+        m_ping_sent = m_last_ping = now;
+        if( !m_ping_unanswered ) m_ping_unanswered = now;
+        send_control( CTRL_PING, ++m_ping_seq, false, true );
+    }
+    schedule_liveness();
+}
+
+void
+Connection::handle_pong( boost::uint32_t seq )
+{
+    // any pong shows the peer is there, even one for an older ping:
+    m_ping_unanswered = 0;
+    if( !m_ping_sent || seq != m_ping_seq ) return;
+    const boost::uint64_t rtt = now_us() - m_ping_sent;
+    m_ping_sent = 0;
+    m_rtt.record( rtt );
+    // smoothed like TCP's srtt:
+    const boost::uint64_t srtt = m_srtt_us.load( boost::memory_order_relaxed );
+    m_srtt_us.store( srtt ? ( srtt * 7 + rtt ) / 8 : rtt,
+                     boost::memory_order_relaxed );
+    // the next keepalive may be due before the timer, unless it has
+    // fired already and check_liveness is on its way:
+    if( !m_shuttingdown && m_liveness_timer &&
+        m_router->timers( m_io_slot ).cancel( m_liveness_timer ) )
+    {
+        schedule_liveness();
+    }
+}
+
+} //ns
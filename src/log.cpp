@@ -0,0 +1,268 @@
+#include "libf2f/log.h"
+
+#include <boost/atomic.hpp>
+#include <boost/bind.hpp>
+#include <boost/thread.hpp>
+#include <boost/thread/tss.hpp>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+namespace libf2f {
+
+using namespace std;
+
+namespace {
+
+/// formats into a fixed array, anything past the end is dropped
+class LineBuf : public std::streambuf
+{
+public:
+    LineBuf() { reset(); }
+    
+    void reset() { setp( m_buf, m_buf + log_line_max ); }
+    const char * data() const { return pbase(); }
+    size_t size() const { return pptr() - pbase(); }
+
+protected:
+    virtual int_type overflow( int_type c ) { return traits_type::not_eof( c ); }
+
+private:
+    char m_buf[log_line_max];
+};
+
+struct LogRecord
+{
+    log_level level;
+    size_t len;
+    char text[log_line_max];
+};
+
+/// One producer thread, one consumer (whoever holds the drain lock).
+/// head and tail only ever increase, slot is index % ring_size.
+struct LogRing
+{
+    static const size_t ring_size = 512;
+    
+    LogRing() : head( 0 ), tail( 0 ), orphaned( false ), os( &buf ) {}
+    
+    LogRecord recs[ring_size];
+    boost::atomic<size_t> head;         // next slot to write
+    boost::atomic<size_t> tail;         // next slot to read
+    boost::atomic<bool> orphaned;       // its thread has gone
+    LineBuf buf;
+    std::ostream os;                    // formats into buf
+};
+
+typedef boost::shared_ptr<LogRing> ring_ptr;
+
+class Logger
+{
+public:
+    Logger()
+        : m_level( LOG_INFO ), m_dropped( 0 ),
+          m_tss( &Logger::release_ring ), m_wake( false ), m_stop( false ),
+          m_sink( new StdioSink )
+    {}
+    
+    ~Logger()
+    {
+        {
+            boost::mutex::scoped_lock lk( m_wait_mutex );
+            m_stop = true;
+        }
+        m_cond.notify_one();
+        if( m_thread.joinable() ) m_thread.join();
+        drain();
+    }
+    
+    /// the calling thread's ring, registered on first use
+    LogRing& ring()
+    {
+        ring_ptr * r = m_tss.get();
+        if( !r )
+        {
+            r = new ring_ptr( new LogRing );
+            m_tss.reset( r );
+            boost::mutex::scoped_lock lk( m_rings_mutex );
+            m_rings.push_back( *r );
+            if( !m_thread.joinable() )
+                m_thread = boost::thread( boost::bind( &Logger::run, this ) );
+        }
+        return **r;
+    }
+    
+    void write( log_level level )
+    {
+        LogRing& r = ring();
+        const size_t h = r.head.load( boost::memory_order_relaxed );
+        if( h - r.tail.load( boost::memory_order_acquire ) == LogRing::ring_size )
+        {
+            m_dropped.fetch_add( 1, boost::memory_order_relaxed );
+        }
+        else
+        {
+            LogRecord& rec = r.recs[ h % LogRing::ring_size ];
+            rec.level = level;
+            rec.len = r.buf.size();
+            memcpy( rec.text, r.buf.data(), rec.len );
+            r.head.store( h + 1, boost::memory_order_release );
+        }
+        r.buf.reset();
+        if( !m_wake.exchange( true, boost::memory_order_acq_rel ) )
+            m_cond.notify_one();
+    }
+    
+    /// write out everything queued in all rings
+    void drain()
+    {
+        boost::mutex::scoped_lock lk( m_drain_mutex );
+        vector< ring_ptr > rings;
+        boost::shared_ptr<LogSink> sink;
+        {
+            boost::mutex::scoped_lock lk2( m_rings_mutex );
+            rings = m_rings;
+            sink = m_sink;
+        }
+        bool wrote = false;
+        for( size_t i = 0; i < rings.size(); ++i )
+        {
+            LogRing& r = *rings[i];
+            size_t t = r.tail.load( boost::memory_order_relaxed );
+            const size_t h = r.head.load( boost::memory_order_acquire );
+            for( ; t != h; ++t )
+            {
+                const LogRecord& rec = r.recs[ t % LogRing::ring_size ];
+                sink->write( rec.level, rec.text, rec.len );
+                wrote = true;
+            }
+            r.tail.store( t, boost::memory_order_release );
+        }
+        if( wrote ) sink->flush();
+        // forget rings of threads that have exited, once they're empty:
+        boost::mutex::scoped_lock lk2( m_rings_mutex );
+        for( size_t i = 0; i < m_rings.size(); )
+        {
+            LogRing& r = *m_rings[i];
+            if( r.orphaned.load( boost::memory_order_acquire ) &&
+                r.tail.load( boost::memory_order_relaxed ) ==
+                    r.head.load( boost::memory_order_acquire ) )
+            {
+                m_rings[i] = m_rings.back();
+                m_rings.pop_back();
+            }
+            else ++i;
+        }
+    }
+    
+    void run()
+    {
+        for(;;)
+        {
+            {
+                boost::mutex::scoped_lock lk( m_wait_mutex );
+                // the timeout covers a wakeup racing with us going to sleep
+                while( !m_wake.load( boost::memory_order_acquire ) && !m_stop )
+                    m_cond.timed_wait( lk, boost::posix_time::milliseconds( 50 ) );
+                if( m_stop ) return;
+                m_wake.store( false, boost::memory_order_release );
+            }
+            drain();
+        }
+    }
+    
+    static void release_ring( ring_ptr * r )
+    {
+        (*r)->orphaned.store( true, boost::memory_order_release );
+        delete r;
+    }
+    
+    boost::atomic<int> m_level;
+    boost::atomic<boost::uint64_t> m_dropped;
+    
+    boost::mutex m_rings_mutex;         // protects m_rings, m_sink, m_thread
+    vector< ring_ptr > m_rings;
+    boost::thread_specific_ptr< ring_ptr > m_tss;
+    
+    boost::mutex m_drain_mutex;         // one drainer at a time
+    boost::mutex m_wait_mutex;
+    boost::condition_variable m_cond;
+    boost::atomic<bool> m_wake;
+    bool m_stop;
+    
+    boost::shared_ptr<LogSink> m_sink;
+    boost::thread m_thread;
+};
+
+Logger&
+logger()
+{
+    static Logger l;
+    return l;
+}
+
+} // anon ns
+
+void
+StdioSink::write( log_level level, const char * msg, size_t len )
+{
+    FILE * f = level >= LOG_WARN ? stderr : stdout;
+    fwrite( msg, 1, len, f );
+    fputc( '\n', f );
+}
+
+void
+StdioSink::flush()
+{
+    fflush( stdout );
+    fflush( stderr );
+}
+
+void
+set_log_sink( boost::shared_ptr<LogSink> sink )
+{
+    Logger& l = logger();
+    boost::mutex::scoped_lock lk( l.m_rings_mutex );
+    l.m_sink = sink;
+}
+
+void
+set_log_level( log_level level )
+{
+    logger().m_level.store( level, boost::memory_order_relaxed );
+}
+
+bool
+log_enabled( log_level level )
+{
+    return level >= logger().m_level.load( boost::memory_order_relaxed );
+}
+
+std::ostream&
+log_stream()
+{
+    LogRing& r = logger().ring();
+    r.buf.reset();
+    r.os.clear();
+    return r.os;
+}
+
+void
+log_write( log_level level )
+{
+    logger().write( level );
+}
+
+void
+log_flush()
+{
+    logger().drain();
+}
+
+boost::uint64_t
+log_dropped()
+{
+    return logger().m_dropped.load( boost::memory_order_relaxed );
+}
+
+} //ns
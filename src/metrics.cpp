@@ -0,0 +1,57 @@
+#include "libf2f/metrics.h"
+
+#include <ctime>
+
+namespace libf2f {
+
+boost::uint64_t
+now_us()
+{
+    timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    return boost::uint64_t( ts.tv_sec ) * 1000000 + ts.tv_nsec / 1000;
+}
+
+boost::uint64_t
+histogram::percentile( double q ) const
+{
+    if( !count ) return 0;
+    const boost::uint64_t rank = boost::uint64_t( q * count );
+    boost::uint64_t seen = 0;
+    for( size_t i = 0; i < num_buckets; ++i )
+    {
+        seen += buckets[i];
+        if( seen > rank ) return i ? ( boost::uint64_t(1) << i ) - 1 : 0;
+    }
+    return ( boost::uint64_t(1) << ( num_buckets - 1 ) ) - 1;
+}
+
+Histogram::Histogram()
+    : m_sum( 0 )
+{
+    for( size_t i = 0; i < histogram::num_buckets; ++i ) m_buckets[i] = 0;
+}
+
+void
+Histogram::record( boost::uint64_t v )
+{
+    size_t b = 0;
+    while( v >> b && b < histogram::num_buckets - 1 ) ++b;
+    m_buckets[b].fetch_add( 1, boost::memory_order_relaxed );
+    m_sum.fetch_add( v, boost::memory_order_relaxed );
+}
+
+histogram
+Histogram::snapshot() const
+{
+    histogram h;
+    for( size_t i = 0; i < histogram::num_buckets; ++i )
+    {
+        h.buckets[i] = m_buckets[i].load( boost::memory_order_relaxed );
+        h.count += h.buckets[i];
+    }
+    h.sum = m_sum.load( boost::memory_order_relaxed );
+    return h;
+}
+
+} //ns
@@ -0,0 +1,152 @@
+#include "libf2f/pool.h"
+
+#include <boost/atomic.hpp>
+#include <boost/thread/tss.hpp>
+#include <cstdlib>
+#include <new>
+
+namespace libf2f {
+
+namespace {
+
+const size_t min_class_size = 32;
+const size_t num_classes = 10;                  // 32 bytes .. 16KB
+const size_t max_cached_bytes = 256*1024;       // per class, per thread
+const size_t min_cached_blocks = 128;           // ..but at least this many
+
+struct free_block
+{
+    free_block * next;
+};
+
+/// size classed free lists for one thread
+struct thread_cache
+{
+    thread_cache()
+    {
+        for( size_t i = 0; i < num_classes; ++i )
+        {
+            head[i] = 0;
+            count[i] = 0;
+        }
+    }
+    
+    ~thread_cache();
+    
+    free_block * head[num_classes];
+    size_t count[num_classes];
+};
+
+boost::atomic<boost::uint64_t> g_system_allocs(0);
+boost::atomic<boost::uint64_t> g_system_frees(0);
+
+thread_cache::~thread_cache()
+{
+    for( size_t i = 0; i < num_classes; ++i )
+    {
+        while( head[i] )
+        {
+            free_block * b = head[i];
+            head[i] = b->next;
+            free( b );
+            g_system_frees.fetch_add( 1, boost::memory_order_relaxed );
+        }
+    }
+}
+
+boost::thread_specific_ptr<thread_cache> t_cache;
+
+inline thread_cache * cache()
+{
+    thread_cache * c = t_cache.get();
+    if( !c )
+    {
+        c = new thread_cache;
+        t_cache.reset( c );
+    }
+    return c;
+}
+
+/// index of the smallest class that holds len, or num_classes if too big
+inline size_t size_class( size_t len )
+{
+    size_t c = 0;
+    size_t sz = min_class_size;
+    while( sz < len && c < num_classes )
+    {
+        sz <<= 1;
+        ++c;
+    }
+    return c;
+}
+
+PoolAllocator g_default_allocator;
+Allocator * g_allocator = &g_default_allocator;
+
+} // anon ns
+
+void *
+PoolAllocator::allocate( size_t len )
+{
+    const size_t c = size_class( len );
+    if( c < num_classes )
+    {
+        thread_cache * tc = cache();
+        if( free_block * b = tc->head[c] )
+        {
+            tc->head[c] = b->next;
+            --tc->count[c];
+            return b;
+        }
+        len = min_class_size << c;
+    }
+    g_system_allocs.fetch_add( 1, boost::memory_order_relaxed );
+    void * p = malloc( len );
+    if( !p ) throw std::bad_alloc();
+    return p;
+}
+
+void
+PoolAllocator::deallocate( void * p, size_t len )
+{
+    if( !p ) return;
+    const size_t c = size_class( len );
+    if( c < num_classes )
+    {
+        thread_cache * tc = cache();
+        if( tc->count[c] < min_cached_blocks ||
+            tc->count[c] * (min_class_size << c) < max_cached_bytes )
+        {
+            free_block * b = static_cast<free_block*>( p );
+            b->next = tc->head[c];
+            tc->head[c] = b;
+            ++tc->count[c];
+            return;
+        }
+    }
+    g_system_frees.fetch_add( 1, boost::memory_order_relaxed );
+    free( p );
+}
+
+pool_stats
+get_pool_stats()
+{
+    pool_stats s;
+    s.system_allocs = g_system_allocs.load( boost::memory_order_relaxed );
+    s.system_frees  = g_system_frees.load( boost::memory_order_relaxed );
+    return s;
+}
+
+Allocator *
+message_allocator()
+{
+    return g_allocator;
+}
+
+void
+set_message_allocator( Allocator * a )
+{
+    g_allocator = a ? a : &g_default_allocator;
+}
+
+} //ns
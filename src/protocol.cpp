@@ -1,4 +1,5 @@
 #include "libf2f/protocol.h"
+#include "libf2f/log.h"
 
 namespace libf2f {
 
@@ -6,27 +7,34 @@ using namespace std;
 
 Protocol::Protocol()
 {
-    cout << "CTOR Protocol" << endl;
+    F2F_DEBUG( "CTOR Protocol" );
 }
 
 bool
 Protocol::new_incoming_connection( connection_ptr conn )
 {
-    cout << "Protocol::new_incoming_connection " << conn->str() << endl;
+    F2F_INFO( "Protocol::new_incoming_connection " << conn->str() );
     return true;
 }
 
 void 
 Protocol::new_outgoing_connection( connection_ptr conn )
 {
-    cout << "Protocol::new_outgoing_connection " << conn->str() << endl;
+    F2F_INFO( "Protocol::new_outgoing_connection " << conn->str() );
 }
 
 void 
 Protocol::message_received( message_ptr msgp, connection_ptr conn )
 {
-    cout << "Protocol::message_received " << conn->str() << endl 
-         << msgp->str() << endl;
+    F2F_INFO( "Protocol::message_received " << conn->str() << " " 
+              << msgp->str() );
+}
+
+void
+Protocol::message_undecodable( message_ptr msgp, connection_ptr conn )
+{
+    F2F_WARN( "Protocol: dropping undecodable msg of type " 
+              << (int)(unsigned char)msgp->type() << " from " << conn->str() );
 }
 
 } //ns
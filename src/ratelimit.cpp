@@ -0,0 +1,62 @@
+#include "libf2f/ratelimit.h"
+#include "libf2f/metrics.h"
+
+#include <algorithm>
+
+namespace libf2f {
+
+namespace {
+
+const boost::int64_t us_per_sec = 1000000;
+
+} // anon ns
+
+TokenBucket::TokenBucket()
+    : m_rate( 0 ), m_tokens( 0 ), m_burst( 0 ), m_last( 0 )
+{
+}
+
+void
+TokenBucket::set_rate( boost::uint64_t rate, boost::uint64_t burst )
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    if( burst == 0 ) burst = rate / 10;
+    m_burst = boost::int64_t( burst ) * us_per_sec;
+    m_tokens = m_burst;
+    m_last = now_us();
+    m_rate.store( rate, boost::memory_order_relaxed );
+}
+
+void
+TokenBucket::refill( boost::uint64_t rate )
+{
+    const boost::uint64_t now = now_us();
+    // anything longer than it takes to fill up is as good as full:
+    const boost::uint64_t full = boost::uint64_t( m_burst - m_tokens ) / rate + 1;
+    const boost::uint64_t elapsed = std::min( now - m_last, full );
+    m_tokens = std::min( m_burst, m_tokens + boost::int64_t( elapsed * rate ) );
+    m_last = now;
+}
+
+boost::uint64_t
+TokenBucket::delay()
+{
+    const boost::uint64_t rate = m_rate.load( boost::memory_order_relaxed );
+    if( !rate ) return 0;
+    boost::mutex::scoped_lock lk( m_mutex );
+    refill( rate );
+    if( m_tokens >= 0 ) return 0;
+    return ( boost::uint64_t( -m_tokens ) + rate - 1 ) / rate;
+}
+
+void
+TokenBucket::consume( size_t n )
+{
+    const boost::uint64_t rate = m_rate.load( boost::memory_order_relaxed );
+    if( !rate ) return;
+    boost::mutex::scoped_lock lk( m_mutex );
+    refill( rate );
+    m_tokens -= boost::int64_t( n ) * us_per_sec;
+}
+
+} //ns
@@ -1,44 +1,321 @@
 #include "libf2f/router.h"
 #include "libf2f/connection.h"
 #include "libf2f/protocol.h"
+#include "libf2f/log.h"
 
 #include <boost/date_time/posix_time/posix_time.hpp>
 #include <boost/thread.hpp>
 #include <boost/foreach.hpp>
+#include <boost/version.hpp>
+#include <algorithm>
+#include <cerrno>
 
 namespace libf2f {
 
 using namespace std;
 
+namespace {
+
+/// true if this thread is running ios's handlers, so whatever we post
+/// to it waits until we return
+bool
+running_in_this_thread( boost::asio::io_service& ios )
+{
+#if BOOST_VERSION >= 106600
+    return ios.get_executor().running_in_this_thread();
+#else
+    return false;
+#endif
+}
+
+} // anon ns
+
 Router::Router( boost::shared_ptr<boost::asio::ip::tcp::acceptor> accp,
-                Protocol * p, boost::function<std::string()> uuidf )
-    :   m_acceptor( accp ),
+                Protocol * p, boost::function<std::string()> uuidf,
+                unsigned int io_threads, IoServicePool::policy policy )
+    :   m_registered( 0 ),
+        m_acceptor( accp ),
+        m_accept_retries( 0 ),
+        m_iopool( io_threads ? new IoServicePool( io_threads, policy ) : 0 ),
+        m_writeq_policy( Connection::WRITEQ_REJECT ),
+        m_max_writeq_size( Connection::default_max_writeq_size ),
+        m_block_timeout_ms( 0 ),
+        m_caps( 0 ),
+        m_compress_threshold( Connection::default_compress_threshold ),
+        m_compress_level( Connection::default_compress_level ),
+        m_conn_rate( 0 ),
+        m_conn_burst( 0 ),
+        m_forwarded( 0 ),
+        m_ttl_expired( 0 ),
         m_protocol( p ),
-        seen_connections(0),
+        m_accepted( 0 ),
+        m_refused( 0 ),
+        m_connected( 0 ),
+        m_connect_failed( 0 ),
+        m_timed_out( 0 ),
         m_uuidgen( uuidf )
 {
-    cout << "Testing uuid generator... " << flush;
+    for( int i = 0; i < 256; ++i )
+    {
+        m_type_priority[i] = Connection::PRIO_NORMAL;
+        m_datagram_type[i] = false;
+        m_msgs_in[i] = m_msgs_out[i] = 0;
+    }
+    if( m_iopool )
+    {
+        for( size_t i = 0; i < m_iopool->size(); ++i )
+            m_timers.push_back( TimerWheel::create( m_iopool->io_service( i ) ) );
+    }
+    else
+    {
+        m_timers.push_back( TimerWheel::create( acceptor_io_service() ) );
+    }
+    m_broadcaster.reset( new Broadcaster( *this ) );
     string uuid = m_uuidgen();
     if( uuid.length() != 36 )
     {
-        cout << "ERROR length must be 36." << endl;
+        F2F_ERROR( "Testing uuid generator... ERROR length must be 36." );
+        log_flush();
         throw;
     }
-    cout << "OK" << endl;
+    F2F_DEBUG( "Testing uuid generator... OK" );
     p->set_router( this );
     // Start an accept operation for a new connection.
-    connection_ptr new_conn = new_connection();
-    
-    m_acceptor->async_accept(new_conn->socket(),
-        boost::bind(&Router::handle_accept, this,
-        boost::asio::placeholders::error, new_conn));
-
+    start_accepts( m_acceptor, any_slot, 1 );
 }
 
 connection_ptr
 Router::new_connection()
 {
-    return connection_ptr( new Connection( m_acceptor->io_service(), this ) );
+    return new_connection( m_iopool ? m_iopool->pick() : 0 );
+}
+
+connection_ptr
+Router::new_connection( size_t io_slot )
+{
+    connection_ptr conn( new Connection( io_service( io_slot ), this ) );
+    conn->set_io_slot( io_slot );
+    apply_settings( conn );
+    return conn;
+}
+
+boost::asio::io_service&
+Router::io_service( size_t slot )
+{
+    return m_iopool ? m_iopool->io_service( slot ) : acceptor_io_service();
+}
+
+boost::asio::ip::tcp::endpoint
+Router::listen( const boost::asio::ip::tcp::endpoint& ep, 
+                unsigned int pending_accepts )
+{
+    using boost::asio::ip::tcp;
+#ifdef SO_REUSEPORT
+    typedef boost::asio::detail::socket_option::boolean< 
+                                    SOL_SOCKET, SO_REUSEPORT > reuse_port;
+    const size_t n = m_timers.size();
+#else
+    const size_t n = 1;
+#endif
+    tcp::endpoint bound = ep;
+    vector< acceptor_ptr > acceptors;
+    for( size_t i = 0; i < n; ++i )
+    {
+        acceptor_ptr a( new tcp::acceptor( io_service( i ) ) );
+        a->open( bound.protocol() );
+        a->set_option( tcp::acceptor::reuse_address( true ) );
+#ifdef SO_REUSEPORT
+        a->set_option( reuse_port( true ) );
+#endif
+        // accepted sockets inherit these, before the handshake:
+        if( m_sockopts.sndbuf ) a->set_option( 
+            tcp::socket::send_buffer_size( m_sockopts.sndbuf ) );
+        if( m_sockopts.rcvbuf ) a->set_option( 
+            tcp::socket::receive_buffer_size( m_sockopts.rcvbuf ) );
+        a->bind( bound );
+        a->listen();
+        // the rest share the first one's port, in case ep's was 0:
+        bound = a->local_endpoint();
+        acceptors.push_back( a );
+    }
+    for( size_t i = 0; i < n; ++i )
+    {
+        m_listeners.push_back( acceptors[i] );
+        start_accepts( acceptors[i], i, std::max( pending_accepts, 1u ) );
+    }
+    F2F_INFO( "Listening on " << bound << " with " << n << " acceptors" );
+    return bound;
+}
+
+boost::asio::ip::udp::endpoint
+Router::enable_datagrams( const boost::asio::ip::udp::endpoint& ep )
+{
+    if( m_datagrams ) return m_datagrams->local_endpoint();
+    m_datagrams = DatagramSocket::create( io_service( 0 ), ep );
+    m_datagrams->start();
+    F2F_INFO( "Datagrams on " << m_datagrams->local_endpoint() );
+    return m_datagrams->local_endpoint();
+}
+
+void
+Router::async_accept( acceptor_ptr a, size_t slot )
+{
+    connection_ptr conn = slot == any_slot ? new_connection()
+                                           : new_connection( slot );
+    a->async_accept( conn->socket(),
+        boost::bind( &Router::handle_accept, this,
+                     boost::asio::placeholders::error, a, slot, conn ) );
+}
+
+void
+Router::start_accepts( acceptor_ptr a, size_t slot, unsigned int n )
+{
+    {
+        boost::mutex::scoped_lock lk( m_accept_mutex );
+        m_accept_chains[ a.get() ] += n;
+    }
+    for( unsigned int i = 0; i < n; ++i ) async_accept( a, slot );
+}
+
+void
+Router::retry_accept( acceptor_ptr a, size_t slot )
+{
+    // the wheel's io_service isn't a's if it's the caller's acceptor:
+    boost::asio::io_service& ios = slot == any_slot ? acceptor_io_service()
+                                                    : io_service( slot );
+    m_accept_retries.fetch_sub( 1 );
+    ios.post( boost::bind( &Router::async_accept, this, a, slot ) );
+}
+
+void
+Router::end_accept_chain( acceptor_ptr a )
+{
+    {
+        boost::mutex::scoped_lock lk( m_accept_mutex );
+        boost::unordered_map< boost::asio::ip::tcp::acceptor*, unsigned int >
+            ::iterator it = m_accept_chains.find( a.get() );
+        if( it != m_accept_chains.end() && --it->second ) return;
+        if( it != m_accept_chains.end() ) m_accept_chains.erase( it );
+    }
+    // nobody accepts on it any more, so don't let the kernel queue
+    // connections on it either:
+    boost::system::error_code ec;
+    if( a->is_open() )
+    {
+        F2F_ERROR( "no accepts left, closing acceptor" );
+        a->close( ec );
+    }
+}
+
+boost::asio::io_service&
+Router::acceptor_io_service()
+{
+#if BOOST_VERSION >= 107000
+    return static_cast<boost::asio::io_service&>(
+                                    m_acceptor->get_executor().context() );
+#else
+    return m_acceptor->get_io_service();
+#endif
+}
+
+void
+Router::apply_settings( connection_ptr conn )
+{
+    conn->set_writeq_policy( m_writeq_policy, m_max_writeq_size, 
+                             m_block_timeout_ms );
+    // no side channel to offer without a socket for it:
+    conn->set_capabilities( m_datagrams ? m_caps 
+                                        : m_caps & ~Connection::CAP_DATAGRAM );
+    conn->set_liveness( m_liveness );
+    conn->set_send_rate( m_conn_rate, m_conn_burst );
+    conn->set_socket_options( m_sockopts );
+    conn->set_compression( m_compress_threshold, m_compress_level );
+}
+
+void
+Router::set_writeq_policy( Connection::writeq_policy p, size_t max_bytes,
+                           unsigned int block_timeout_ms )
+{
+    m_writeq_policy = p;
+    m_max_writeq_size = max_bytes;
+    m_block_timeout_ms = block_timeout_ms;
+}
+
+void
+Router::set_flood_routing( bool on, size_t cache_size, 
+                           unsigned int max_age_ms )
+{
+    m_seen.reset( on ? new GuidCache( cache_size, max_age_ms ) : 0 );
+}
+
+flood_stats
+Router::get_flood_stats()
+{
+    flood_stats st;
+    if( m_seen ) st.cache = m_seen->stats();
+    st.forwarded = m_forwarded.load();
+    st.ttl_expired = m_ttl_expired.load();
+    return st;
+}
+
+vector<connection_ptr>
+Router::flood( message_ptr msgp )
+{
+    if( m_seen ) m_seen->check_and_insert( msgp->header().guid );
+    return send_all( msgp );
+}
+
+bool
+Router::route_message( message_ptr msgp, connection_ptr from )
+{
+    message_header& h = msgp->header();
+    if( m_seen->check_and_insert( h.guid ) ) return false;
+    // nobody else has a ref yet, so it's safe to modify in place:
+    unsigned char ttl = h.ttl;
+    if( ttl ) --ttl;
+    h.ttl = ttl;
+    ++h.hops;
+    if( !ttl )
+    {
+        ++m_ttl_expired;
+        return true;
+    }
+    ++m_forwarded;
+    conn_snapshot_ptr conns = connections();
+    BOOST_FOREACH( const connection_ptr& c, *conns )
+    {
+        if( c != from ) c->async_write( msgp );
+    }
+    return true;
+}
+
+void
+Router::writeq_watermark( connection_ptr conn, bool high )
+{
+    if( high )
+        m_protocol->writeq_high_watermark( conn );
+    else
+        m_protocol->writeq_low_watermark( conn );
+}
+
+bool
+Router::stream_opened( connection_ptr conn, stream_id id, char type,
+                       boost::uint64_t length, const std::string& meta )
+{
+    return m_protocol->stream_opened( conn, id, type, length, meta );
+}
+
+void
+Router::stream_data( connection_ptr conn, stream_id id, 
+                     const char * data, size_t len )
+{
+    m_protocol->stream_data( conn, id, data, len );
+}
+
+void
+Router::stream_closed( connection_ptr conn, stream_id id, bool complete )
+{
+    m_protocol->stream_closed( conn, id, complete );
 }
                 
 std::string 
@@ -50,67 +327,152 @@ Router::gen_uuid()
 void
 Router::stop()
 {
-    while( m_connections.size() )
+    // no more incoming:
+    for( size_t i = 0; i < m_listeners.size(); ++i )
+    {
+        boost::system::error_code ec;
+        m_listeners[i]->close( ec );
+    }
+    // fin removes each connection from m_connections. Outgoing connects
+    // may still register more while we wait, those get fin'd next round:
+    boost::mutex::scoped_lock lk( m_connections_mutex );
+    while( !m_connections.empty() )
     {
-        // this removes the connection from m_connections:
-        m_connections.front()->fin();
+        const conn_list conns( m_connections );
+        const boost::uint64_t registered = m_registered;
+        lk.unlock();
+        BOOST_FOREACH( const connection_ptr& conn, conns )
+        {
+            boost::asio::io_service& ios = io_service( conn->io_slot() );
+            // a fin posted to the strand would never run if we're the
+            // thread meant to run it, or nobody is:
+            if( running_in_this_thread( ios ) || ios.stopped() )
+                conn->fin_inline();
+            else
+                conn->fin();
+        }
+        lk.lock();
+        while( !m_connections.empty() && m_registered == registered )
+            m_connections_cond.wait( lk );
     }
+    // one that's unregistered may still be telling the Broadcaster and
+    // Protocol, which we mustn't pull out from under it. Unless that's
+    // us, stopping from Protocol::connection_terminated:
+    while( others_terminating() ) m_connections_cond.wait( lk );
+    lk.unlock();
+    for( size_t i = 0; i < m_timers.size(); ++i ) m_timers[i]->stop();
+    if( m_datagrams ) m_datagrams->stop();
+    if( m_iopool ) m_iopool->stop();
 }
 
 void
 Router::connection_terminated( connection_ptr conn )
 {
+    const boost::thread::id me = boost::this_thread::get_id();
+    {
+        boost::mutex::scoped_lock lk( m_connections_mutex );
+        m_terminating.push_back( me );
+    }
     unregister_connection( conn );
+    m_broadcaster->remove( conn );
     m_protocol->connection_terminated( conn );
+    boost::mutex::scoped_lock lk( m_connections_mutex );
+    m_terminating.erase( std::find( m_terminating.begin(),
+                                    m_terminating.end(), me ) );
+    m_connections_cond.notify_all();
+}
+
+bool
+Router::others_terminating() const
+{
+    const boost::thread::id me = boost::this_thread::get_id();
+    for( size_t i = 0; i < m_terminating.size(); ++i )
+        if( m_terminating[i] != me ) return true;
+    return false;
 }
 
 /// Handle completion of a accept operation.
 void 
-Router::handle_accept(const boost::system::error_code& e, connection_ptr conn)
+Router::handle_accept( const boost::system::error_code& e, acceptor_ptr a,
+                       size_t slot, connection_ptr conn )
 {
     if(e)
     {
-        // Log it and return. Since we are not starting a new
-        // accept operation the io_service will run out of work to do and the
-        // Servent will exit.
-        std::cerr << e.message() << std::endl;
+        namespace error = boost::asio::error;
+        if( e == error::operation_aborted || !a->is_open() )
+        {
+            // closed, by stop() or its owner
+            end_accept_chain( a );
+            return;
+        }
+        if( e == error::no_descriptors || e.value() == ENFILE ||
+            e == error::no_buffer_space || e == error::no_memory )
+        {
+            // out of fds or memory, which takes a while to clear up.
+            // Meanwhile the kernel keeps queueing connections for us.
+            // Every chain hits it at once, so only the first one says so:
+            if( m_accept_retries.fetch_add( 1 ) == 0 )
+                F2F_WARN( "accept failed: " << e.message() << ", retrying "
+                          "every " << accept_retry_ms << "ms" );
+            m_timers[ slot == any_slot ? 0 : slot ]->add( accept_retry_ms,
+                boost::bind( &Router::retry_accept, this, a, slot ) );
+            return;
+        }
+        if( e == error::connection_aborted || e == error::connection_reset ||
+            e == error::interrupted || e == error::try_again ||
+            e == error::would_block || e.value() == EPROTO ||
+            e.value() == EPERM )
+        {
+            // that connection's gone, not the acceptor
+            F2F_DEBUG( "accept failed: " << e.message() );
+            async_accept( a, slot );
+            return;
+        }
+        F2F_ERROR( "accept failed: " << e.message() );
+        end_accept_chain( a );
         return;
     }
+    m_accepted.fetch_add( 1, boost::memory_order_relaxed );
+    // Start an accept operation for a new connection, so a slow Protocol
+    // doesn't hold up the ones queued behind this one:
+    async_accept( a, slot );
+    conn->strand().dispatch( boost::bind( &Router::admit, this, conn ) );
+}
+
+void
+Router::admit( connection_ptr conn )
+{
     if( !m_protocol->new_incoming_connection(conn) )
     {
         // cout << "Rejecting connection " << conn->str() << endl;
+        m_refused.fetch_add( 1, boost::memory_order_relaxed );
         // don't register it (so it autodestructs)
+        return;
     }
-    else
-    {
-        register_connection( conn );
-        conn->async_read();
-    }
-    
-    // Start an accept operation for a new connection.
-    connection_ptr new_conn = new_connection();
-    
-    m_acceptor->async_accept(new_conn->socket(),
-        boost::bind(&Router::handle_accept, this,
-            boost::asio::placeholders::error, new_conn));
+    apply_settings( conn );
+    register_connection( conn );
+    conn->start();
 }
 
 void
 Router::register_connection( connection_ptr conn )
 {
     boost::mutex::scoped_lock lk(m_connections_mutex);
-    vector<connection_ptr>::iterator it;
-    for( it=m_connections.begin() ; it < m_connections.end() ; ++it )
+    if( m_conn_index.find( conn.get() ) != m_conn_index.end() )
     {
-        if( *it == conn )
-        {
-            // already registered, wtf?
-            cout << "ERROR connection already registered!" << endl;
-            assert(false);
-            return;
-        }
+        // already registered, wtf?
+        F2F_ERROR( "ERROR connection already registered!" );
+        assert(false);
+        return;
     }
-    m_connections.push_back( conn );
+    conn_list::iterator it = m_connections.insert( m_connections.end(), conn );
+    m_conn_index[ conn.get() ] = it;
+    ++m_registered;
+    m_connections_cond.notify_all();
+    boost::atomic_store( &m_snapshot, conn_snapshot_ptr() );
+    if( !conn->name().empty() )
+        m_name_index.insert( make_pair( conn->name(), it ) );
+    if( m_iopool ) m_iopool->add_load( conn->io_slot(), 1 );
     //cout << connections_str() << endl;
 }
 
@@ -118,31 +480,86 @@ void
 Router::unregister_connection( connection_ptr conn )
 {
     boost::mutex::scoped_lock lk(m_connections_mutex);
-    vector<connection_ptr>::iterator it;
-    for( it=m_connections.begin() ; it < m_connections.end() ; ++it )
+    boost::unordered_map< Connection*, conn_list::iterator >::iterator ci =
+        m_conn_index.find( conn.get() );
+    if( ci == m_conn_index.end() ) return;
+    unindex_name( conn.get() );
+    m_connections.erase( ci->second );
+    m_conn_index.erase( ci );
+    m_connections_cond.notify_all();
+    boost::atomic_store( &m_snapshot, conn_snapshot_ptr() );
+    if( m_iopool ) m_iopool->add_load( conn->io_slot(), -1 );
+    //cout << "Router::unregistered " << conn->str() << endl;
+}
+
+void
+Router::unindex_name( Connection * conn )
+{
+    if( conn->name().empty() ) return;
+    typedef boost::unordered_multimap< string, conn_list::iterator >::iterator 
+            name_it;
+    pair<name_it, name_it> r = m_name_index.equal_range( conn->name() );
+    for( name_it it = r.first; it != r.second; ++it )
     {
-        if( *it == conn )
+        if( it->second->get() == conn )
         {
-            m_connections.erase( it );
-            //cout << "Router::unregistered " << conn->str() << endl;
+            m_name_index.erase( it );
+            return;
         }
     }
-    //cout << connections_str() << endl;
+}
+
+void
+Router::rename_connection( Connection * conn, const std::string& name )
+{
+    boost::mutex::scoped_lock lk(m_connections_mutex);
+    boost::unordered_map< Connection*, conn_list::iterator >::iterator ci =
+        m_conn_index.find( conn );
+    if( ci == m_conn_index.end() )
+    {
+        // not registered (yet), nothing to reindex
+        conn->m_name = name;
+        return;
+    }
+    unindex_name( conn );
+    conn->m_name = name;
+    if( !name.empty() )
+        m_name_index.insert( make_pair( name, ci->second ) );
 }
 
 connection_ptr 
 Router::get_connection_by_name( const std::string &name )
 {
-    vector<connection_ptr>::iterator it;
     boost::mutex::scoped_lock lk(m_connections_mutex);
-    for( it=m_connections.begin() ; it < m_connections.end() ; ++it )
+    boost::unordered_multimap< string, conn_list::iterator >::iterator it =
+        m_name_index.find( name );
+    if( it == m_name_index.end() ) return connection_ptr();
+    return *it->second;
+}
+
+size_t
+Router::num_connections()
+{
+    boost::mutex::scoped_lock lk(m_connections_mutex);
+    return m_connections.size();
+}
+
+router_metrics
+Router::get_metrics()
+{
+    router_metrics m;
+    m.accepted = m_accepted.load( boost::memory_order_relaxed );
+    m.refused = m_refused.load( boost::memory_order_relaxed );
+    m.connected = m_connected.load( boost::memory_order_relaxed );
+    m.connect_failed = m_connect_failed.load( boost::memory_order_relaxed );
+    m.connections = num_connections();
+    m.timed_out = m_timed_out.load( boost::memory_order_relaxed );
+    for( size_t i = 0; i < 256; ++i )
     {
-        if( (*it)->name() == name )
-        {
-            return *it;
-        }
+        m.msgs_in[i] = m_msgs_in[i].load( boost::memory_order_relaxed );
+        m.msgs_out[i] = m_msgs_out[i].load( boost::memory_order_relaxed );
     }
-    return connection_ptr();
+    return m;
 }
 
 /// debug usage - get list of connections
@@ -151,7 +568,7 @@ Router::connections_str()
 {
     ostringstream os;
     os << "<connections>" << endl;
-    BOOST_FOREACH( connection_ptr conn, m_connections )
+    BOOST_FOREACH( const connection_ptr& conn, *connections() )
     {
         os << conn->str() << endl;
     }
@@ -186,12 +603,13 @@ Router::message_received( message_ptr msgp, connection_ptr conn )
         return;
     }
     */
-    if( msgp->length() > 16384 ) // hard limit
+    if( msgp->length() > max_payload_size ) // hard limit
     {
-        cout << "f2f router: Dropping, msg length: " << msgp->length() << endl;
+        F2F_WARN( "f2f router: Dropping, msg length: " << msgp->length() );
         return;
     }
-    m_protocol->message_received( msgp, conn );
+    if( m_seen && !route_message( msgp, conn ) ) return;
+    m_protocol->dispatch( msgp, conn );
 }
 
 /// Connect out to a remote Servent at endpoint
@@ -205,8 +623,8 @@ Router::connect_to_remote(boost::asio::ip::tcp::endpoint &endpoint)
 void 
 Router::connect_to_remote(boost::asio::ip::tcp::endpoint &endpoint, const map<string,string>& props)
 {
-    cout << "router::connect_to_remote(" << endpoint.address().to_string()<<":"
-         << endpoint.port()<<")" << endl;
+    F2F_INFO( "router::connect_to_remote(" << endpoint.address().to_string()<<":"
+              << endpoint.port()<<")" );
     connection_ptr new_conn = new_connection();
     typedef pair<string,string> pair_t;
     BOOST_FOREACH( pair_t p, props )
@@ -215,8 +633,9 @@ Router::connect_to_remote(boost::asio::ip::tcp::endpoint &endpoint, const map<st
     }
     // Start an asynchronous connect operation.
     new_conn->socket().async_connect(endpoint,
+        new_conn->strand().wrap(
         boost::bind(&Router::handle_connect, this,
-        boost::asio::placeholders::error, endpoint, new_conn));
+        boost::asio::placeholders::error, endpoint, new_conn)));
 }
 
 /// Handle completion of a connect operation.
@@ -227,50 +646,70 @@ Router::handle_connect( const boost::system::error_code& e,
 {
     if (e)
     {
-        std::cerr   << "Failed to connect out to remote Servent: " 
-                    << e.message() << std::endl;
+        F2F_WARN( "Failed to connect out to remote Servent: " 
+                  << e.message() );
+        m_connect_failed.fetch_add( 1, boost::memory_order_relaxed );
         return;
     }
+    m_connected.fetch_add( 1, boost::memory_order_relaxed );
     /// Successfully established connection. 
     m_protocol->new_outgoing_connection( conn );
     register_connection( conn );
-    conn->async_read(); // start read loop for this connection
+    conn->start(); // start read loop for this connection
+}
+
+Router::conn_snapshot_ptr
+Router::connections()
+{
+    conn_snapshot_ptr snap = boost::atomic_load( &m_snapshot );
+    if( snap ) return snap;
+    boost::mutex::scoped_lock lk(m_connections_mutex);
+    // someone else may have rebuilt it while we waited for the lock:
+    snap = boost::atomic_load( &m_snapshot );
+    if( !snap )
+    {
+        snap.reset( new conn_snapshot( m_connections.begin(), 
+                                       m_connections.end() ) );
+        boost::atomic_store( &m_snapshot, snap );
+    }
+    return snap;
 }
 
 /// apply fun to all connections
 void 
 Router::foreach_conns( boost::function<void(connection_ptr)> fun )
 {
-    boost::mutex::scoped_lock lk(m_connections_mutex);
-    BOOST_FOREACH( connection_ptr conn, m_connections )
+    conn_snapshot_ptr conns = connections();
+    BOOST_FOREACH( const connection_ptr& conn, *conns )
     {
         fun( conn );
     }
 }
 
-
-
 void 
 Router::foreach_conns_except( boost::function<void(connection_ptr)> fun, connection_ptr conn )
 {
-    boost::mutex::scoped_lock lk(m_connections_mutex);
-    BOOST_FOREACH( connection_ptr c, m_connections )
+    conn_snapshot_ptr conns = connections();
+    BOOST_FOREACH( const connection_ptr& c, *conns )
     {
         if( c == conn ) continue;
         fun( c );
     }
 }
 
-void 
+vector<connection_ptr>
 Router::send_all( message_ptr msgp )
 {
     //foreach_conns( boost::bind(&Connection::async_write, _1, msgp) );
-    boost::mutex::scoped_lock lk(m_connections_mutex);
-    BOOST_FOREACH( connection_ptr conn, m_connections )
+    vector<connection_ptr> skipped;
+    conn_snapshot_ptr conns = connections();
+    BOOST_FOREACH( const connection_ptr& conn, *conns )
     {
         //cout << "Sending " << msgp->str() << " to " << conn->str() << endl;
-        conn->async_write( msgp );
+        if( conn->async_write( msgp ) != Connection::WRITE_QUEUED )
+            skipped.push_back( conn );
     }
+    return skipped;
 }
 
 
@@ -0,0 +1,152 @@
+#include "libf2f/connection.h"
+#include "libf2f/router.h"
+#include "libf2f/log.h"
+
+#include <boost/bind.hpp>
+#include <boost/functional/hash.hpp>
+#include <cstring>
+
+namespace libf2f {
+
+using namespace std;
+
+namespace {
+
+void
+fulfil( boost::shared_ptr< boost::promise<message_ptr> > p,
+        const boost::system::error_code& e, message_ptr msgp )
+{
+    if( e )
+        p->set_exception( boost::copy_exception(
+                                    boost::system::system_error( e ) ) );
+    else p->set_value( msgp );
+}
+
+} // anon ns
+
+size_t
+Connection::guid_key_hash::operator()( const guid_key& k ) const
+{
+    return boost::hash_range( k.begin(), k.end() );
+}
+
+Connection::guid_key
+Connection::request_key( const message_ptr& msgp )
+{
+    guid_key k;
+    memcpy( k.data(), msgp->header().guid, k.size() );
+    return k;
+}
+
+Connection::write_result
+Connection::request( message_ptr msgp, unsigned int timeout_ms,
+                     response_handler handler )
+{
+    const guid_key k = request_key( msgp );
+    {
+        boost::mutex::scoped_lock lk( m_rpc_mutex );
+        // fin sets m_shuttingdown before taking this lock to abort, so
+        // nothing gets in after that:
+        if( m_shuttingdown || m_requests.count( k ) ) return WRITE_REJECTED;
+        pending_request& r = m_requests[k];
+        r.handler = handler;
+        r.timer = 0;
+        m_num_requests.store( m_requests.size() );
+    }
+    const write_result res = async_write( msgp );
+    boost::mutex::scoped_lock lk( m_rpc_mutex );
+    request_map::iterator it = m_requests.find( k );
+    if( it == m_requests.end() ) return res; // cancelled or answered already
+    if( res != WRITE_QUEUED )
+    {
+        m_requests.erase( it );
+        m_num_requests.store( m_requests.size() );
+    }
+    else if( timeout_ms )
+    {
+        // the timer only starts now, so a write that blocked on a full
+        // writeq can't have timed out before we knew it was queued
+        it->second.timer = m_router->timers( m_io_slot ).add( timeout_ms,
+            boost::bind( &Connection::request_timed_out,
+                         connection_ptr_weak( shared_from_this() ), k ) );
+    }
+    return res;
+}
+
+boost::unique_future<message_ptr>
+Connection::request( message_ptr msgp, unsigned int timeout_ms )
+{
+    boost::shared_ptr< boost::promise<message_ptr> > p(
+                                        new boost::promise<message_ptr> );
+    boost::unique_future<message_ptr> f = p->get_future();
+    const write_result res = request( msgp, timeout_ms,
+                                      boost::bind( &fulfil, p, _1, _2 ) );
+    if( res != WRITE_QUEUED && !f.is_ready() )
+    {
+        fulfil( p, boost::asio::error::no_buffer_space, message_ptr() );
+    }
+    return boost::move( f );
+}
+
+bool
+Connection::cancel_request( const message_ptr& msgp )
+{
+    return complete_request( request_key( msgp ),
+                             boost::asio::error::operation_aborted,
+                             message_ptr() );
+}
+
+Connection::write_result
+Connection::reply( const message_ptr& request, message_ptr response )
+{
+    memcpy( response->header().guid, request->header().guid, 36 );
+    return async_write( response );
+}
+
+bool
+Connection::complete_request( const guid_key& k,
+                              const boost::system::error_code& e,
+                              message_ptr msgp )
+{
+    pending_request r;
+    {
+        boost::mutex::scoped_lock lk( m_rpc_mutex );
+        request_map::iterator it = m_requests.find( k );
+        if( it == m_requests.end() ) return false;
+        r = it->second;
+        m_requests.erase( it );
+        m_num_requests.store( m_requests.size() );
+    }
+    if( r.timer && e != boost::asio::error::timed_out )
+        m_router->timers( m_io_slot ).cancel( r.timer );
+    m_strand.dispatch( boost::bind( r.handler, e, msgp ) );
+    return true;
+}
+
+void
+Connection::request_timed_out( connection_ptr_weak conn, guid_key k )
+{
+    connection_ptr c = conn.lock();
+    if( !c ) return;
+    if( c->complete_request( k, boost::asio::error::timed_out, message_ptr() ) )
+        F2F_DEBUG( "Request timed out on " << c->str() );
+}
+
+void
+Connection::abort_requests()
+{
+    request_map reqs;
+    {
+        boost::mutex::scoped_lock lk( m_rpc_mutex );
+        reqs.swap( m_requests );
+        m_num_requests.store( 0 );
+    }
+    for( request_map::iterator it = reqs.begin(); it != reqs.end(); ++it )
+    {
+        if( it->second.timer )
+            m_router->timers( m_io_slot ).cancel( it->second.timer );
+        it->second.handler( boost::asio::error::operation_aborted, message_ptr() );
+    }
+}
+
+} //ns
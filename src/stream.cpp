@@ -0,0 +1,636 @@
+#include "libf2f/connection.h"
+#include "libf2f/router.h"
+#include "libf2f/log.h"
+
+#include <boost/bind.hpp>
+#include <boost/version.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+namespace libf2f {
+
+using namespace std;
+
+namespace {
+
+/// stream msgs don't need a unique guid, this one packs small in v2
+const char stream_guid[] = "00000000-0000-0000-0000-000000000000";
+
+int
+read_string( boost::shared_ptr<const string> s, boost::shared_ptr<size_t> off,
+             char * buf, size_t len )
+{
+    const size_t n = std::min( len, s->size() - *off );
+    memcpy( buf, s->data() + *off, n );
+    *off += n;
+    return n;
+}
+
+int
+read_istream( boost::shared_ptr<istream> is, char * buf, size_t len )
+{
+    if( !*is ) return is->eof() ? 0 : -1;
+    is->read( buf, len );
+    if( is->gcount() ) return is->gcount();
+    return is->bad() ? -1 : 0;
+}
+
+int
+read_fd( fd_ptr f, char * buf, size_t len )
+{
+    for(;;)
+    {
+        const ssize_t n = ::read( f->fd(), buf, len );
+        if( n < 0 && errno == EINTR ) continue;
+        return n < 0 ? -1 : n;
+    }
+}
+
+void
+put_u32( char * p, boost::uint32_t v )
+{
+    v = htonl( v );
+    memcpy( p, &v, 4 );
+}
+
+boost::uint32_t
+get_u32( const char * p )
+{
+    boost::uint32_t v;
+    memcpy( &v, p, 4 );
+    return ntohl( v );
+}
+
+/// A stream fragment whose data is sent from a file with sendfile. Only
+/// the subtype and stream id are in memory.
+class FileRegionMessage : public Message
+{
+public:
+    FileRegionMessage( const message_header& h, fd_ptr file, 
+                       boost::uint64_t offset, size_t len )
+        : Message( h ), m_file( file ), m_offset( offset ), m_len( len )
+    {
+        m_header.length = htonl( 5 );
+        malloc_payload();
+        m_header.length = htonl( 5 + len );
+    }
+    
+    virtual size_t append_payload_buffers( std::vector<boost::asio::const_buffer>& buffers ) const
+    {
+        buffers.push_back( boost::asio::buffer( m_payload, 5 ) );
+        return 1;
+    }
+    
+    virtual bool file_region( int * fd, boost::uint64_t * offset, 
+                              size_t * len ) const
+    {
+        *fd = m_file->fd();
+        *offset = m_offset;
+        *len = m_len;
+        return true;
+    }
+    
+private:
+    fd_ptr m_file;
+    boost::uint64_t m_offset;
+    size_t m_len;
+};
+
+} // anon ns
+
+FileDescriptor::~FileDescriptor()
+{
+    if( m_fd >= 0 ) ::close( m_fd );
+}
+
+stream_source
+source_from_string( boost::shared_ptr<const string> s )
+{
+    return boost::bind( &read_string, s, 
+                        boost::shared_ptr<size_t>( new size_t(0) ), _1, _2 );
+}
+
+stream_source
+source_from_istream( boost::shared_ptr<istream> is )
+{
+    return boost::bind( &read_istream, is, _1, _2 );
+}
+
+stream_source
+source_from_fd( int fd )
+{
+    return boost::bind( &read_fd, fd_ptr( new FileDescriptor( fd ) ), _1, _2 );
+}
+
+stream_id
+Connection::open_stream( char type, stream_source src, boost::uint64_t length,
+                         const std::string& meta, stream_done_cb done )
+{
+    if( !( m_caps & m_peer_caps & CAP_STREAMS ) ) return 0;
+    if( meta.size() > max_payload_size - 14 ) return 0;
+    stream_id id = ++m_next_stream_id;
+    if( !id ) id = ++m_next_stream_id; // wrapped
+    out_stream s;
+    s.src = src;
+    s.done = done;
+    m_strand.dispatch( boost::bind( &Connection::start_stream, 
+                                    shared_from_this(), id, type, 
+                                    length, meta, s ) );
+    return id;
+}
+
+stream_id
+Connection::send_file( char type, int fd, boost::uint64_t offset,
+                       boost::uint64_t length, const std::string& meta,
+                       stream_done_cb done )
+{
+    fd_ptr file( new FileDescriptor( fd ) );
+    if( !( m_caps & m_peer_caps & CAP_STREAMS ) ) return 0;
+    if( meta.size() > max_payload_size - 14 ) return 0;
+    // once a fragment's header is out, the file running short would cost
+    // us the connection:
+    struct stat st;
+    if( fstat( fd, &st ) || offset > boost::uint64_t( st.st_size ) ||
+        length > boost::uint64_t( st.st_size ) - offset )
+    {
+        return 0;
+    }
+    stream_id id = ++m_next_stream_id;
+    if( !id ) id = ++m_next_stream_id; // wrapped
+    out_stream s;
+    s.file = file;
+    s.offset = offset;
+    s.remaining = length;
+    s.done = done;
+    m_strand.dispatch( boost::bind( &Connection::start_stream, 
+                                    shared_from_this(), id, type, 
+                                    length, meta, s ) );
+    return id;
+}
+
+void
+Connection::cancel_stream( stream_id id )
+{
+    m_strand.dispatch( boost::bind( &Connection::end_stream, 
+                                    shared_from_this(), id, false, true ) );
+}
+
+message_ptr
+Connection::stream_msg( char subtype, stream_id id, size_t extra )
+{
+    message_header h;
+    memcpy( h.guid, stream_guid, 36 );
+    h.type = control_msg_type;
+    h.ttl = 1;
+    h.hops = 0;
+    h.length = htonl( 5 + extra );
+    message_ptr msgp( new Message( h ) );
+    msgp->malloc_payload();
+    msgp->payload()[0] = subtype;
+    put_u32( msgp->payload() + 1, id );
+    return msgp;
+}
+
+void
+Connection::start_stream( stream_id id, char type, boost::uint64_t length, 
+                          const std::string& meta, out_stream s )
+{
+    if( m_shuttingdown )
+    {
+        if( s.done ) s.done( false );
+        return;
+    }
+    message_ptr msgp = stream_msg( CTRL_STREAM_OPEN, id, 9 + meta.size() );
+    char * p = msgp->payload() + 5;
+    p[0] = type;
+    put_u32( p + 1, length >> 32 );
+    put_u32( p + 5, length & 0xffffffff );
+    memcpy( p + 9, meta.data(), meta.size() );
+    // stream msgs are bounded by the window rather than the writeq limit:
+    queue_write( msgp, PRIO_BULK, false );
+    
+    m_out_streams[id] = s;
+    pump_streams();
+}
+
+/// Sends a fragment from each stream with window in turn, until they are
+/// all out of window or data.
+void
+Connection::pump_streams()
+{
+    bool progress = true;
+    while( progress && !m_shuttingdown )
+    {
+        progress = false;
+        std::map< stream_id, out_stream >::iterator it = m_out_streams.begin();
+        while( it != m_out_streams.end() )
+        {
+            const stream_id id = it->first;
+            out_stream& s = it->second;
+            ++it; // end_stream may erase this one
+            if( !s.credit ) continue;
+            message_ptr msgp;
+            int got;
+            if( s.file )
+            {
+                if( !s.remaining )
+                {
+                    end_stream( id, true, true );
+                    continue;
+                }
+                got = std::min( boost::uint64_t( std::min( file_fragment_size, 
+                                                           s.credit ) ), 
+                                s.remaining );
+#ifdef __linux__
+                message_header h;
+                memcpy( h.guid, stream_guid, 36 );
+                h.type = control_msg_type;
+                h.ttl = 1;
+                h.hops = 0;
+                msgp = new FileRegionMessage( h, s.file, s.offset, got );
+                msgp->payload()[0] = CTRL_STREAM_DATA;
+                put_u32( msgp->payload() + 1, id );
+#else
+                // no sendfile, read it in:
+                msgp = stream_msg( CTRL_STREAM_DATA, id, got );
+                if( pread( s.file->fd(), msgp->payload() + 5, got, 
+                           s.offset ) != got )
+                {
+                    end_stream( id, false, true );
+                    continue;
+                }
+#endif
+                s.offset += got;
+                s.remaining -= got;
+            }
+            else
+            {
+                const size_t n = std::min( stream_fragment_size, s.credit );
+                msgp = stream_msg( CTRL_STREAM_DATA, id, n );
+                got = s.src( msgp->payload() + 5, n );
+                if( got <= 0 )
+                {
+                    end_stream( id, got == 0, true );
+                    continue;
+                }
+                if( size_t(got) < n ) msgp->header().length = htonl( 5 + got );
+            }
+            s.credit -= got;
+            queue_write( msgp, PRIO_BULK, false );
+            progress = true;
+        }
+    }
+}
+
+void
+Connection::end_stream( stream_id id, bool ok, bool tell_peer )
+{
+    std::map< stream_id, out_stream >::iterator it = m_out_streams.find( id );
+    if( it == m_out_streams.end() ) return;
+    stream_done_cb done = it->second.done;
+    m_out_streams.erase( it );
+    if( tell_peer && !m_shuttingdown )
+    {
+        queue_write( stream_msg( ok ? CTRL_STREAM_END : CTRL_STREAM_ABORT, 
+                                 id, 0 ), PRIO_BULK, false );
+    }
+    if( done ) done( ok );
+}
+
+void
+Connection::handle_stream_control( message_ptr msgp )
+{
+    const char * p = msgp->payload();
+    const size_t len = msgp->length();
+    const stream_id id = get_u32( p + 1 );
+    connection_ptr self = shared_from_this();
+    switch( p[0] )
+    {
+        case CTRL_STREAM_OPEN:
+        {
+            if( len < 14 || !( m_caps & CAP_STREAMS ) || 
+                m_in_streams.count( id ) )
+            {
+                queue_write( stream_msg( CTRL_STREAM_STOP, id, 0 ), 
+                             PRIO_HIGH, false );
+                break;
+            }
+            // there already, so the Protocol can sink_stream it:
+            m_in_streams[id] = in_stream();
+            if( !m_router->stream_opened( self, id, p[5], 
+                        ( boost::uint64_t( get_u32( p + 6 ) ) << 32 ) | 
+                        get_u32( p + 10 ),
+                        string( p + 14, len - 14 ) ) )
+            {
+                if( m_in_streams[id].sink ) --m_num_sinks;
+                m_in_streams.erase( id );
+                queue_write( stream_msg( CTRL_STREAM_STOP, id, 0 ), 
+                             PRIO_HIGH, false );
+            }
+            break;
+        }
+        case CTRL_STREAM_DATA:
+        {
+            // not there if we refused it:
+            std::map< stream_id, in_stream >::iterator it = 
+                m_in_streams.find( id );
+            if( it == m_in_streams.end() ) break;
+            if( it->second.sink )
+            {
+                if( !sink_write( id, p + 5, len - 5 ) ) break;
+            }
+            else
+            {
+                m_router->stream_data( self, id, p + 5, len - 5 );
+            }
+            stream_consumed( id, len - 5 );
+            break;
+        }
+        case CTRL_STREAM_END:
+        case CTRL_STREAM_ABORT:
+        {
+            std::map< stream_id, in_stream >::iterator it = 
+                m_in_streams.find( id );
+            if( it == m_in_streams.end() ) break;
+            if( it->second.sink ) --m_num_sinks;
+            m_in_streams.erase( it );
+            m_router->stream_closed( self, id, p[0] == CTRL_STREAM_END );
+            break;
+        }
+        
+        case CTRL_STREAM_STOP:
+            end_stream( id, false, false );
+            break;
+        
+        case CTRL_STREAM_WINDOW:
+        {
+            std::map< stream_id, out_stream >::iterator it = 
+                m_out_streams.find( id );
+            if( len < 9 || it == m_out_streams.end() ) break;
+            it->second.credit += get_u32( p + 5 );
+            pump_streams();
+            break;
+        }
+        default: // from a newer peer, ignore
+            break;
+    }
+}
+
+void
+Connection::close_streams()
+{
+    connection_ptr self = shared_from_this();
+    std::map< stream_id, out_stream > out;
+    out.swap( m_out_streams );
+    for( std::map< stream_id, out_stream >::iterator it = out.begin();
+         it != out.end(); ++it )
+    {
+        if( it->second.done ) it->second.done( false );
+    }
+    std::map< stream_id, in_stream > in;
+    in.swap( m_in_streams );
+    m_num_sinks = 0;
+    for( std::map< stream_id, in_stream >::iterator it = in.begin();
+         it != in.end(); ++it )
+    {
+        m_router->stream_closed( self, it->first, false );
+    }
+}
+
+void
+Connection::stream_consumed( stream_id id, size_t len )
+{
+    std::map< stream_id, in_stream >::iterator it = m_in_streams.find( id );
+    if( it == m_in_streams.end() ) return;
+    // the sender can have the room back:
+    it->second.unacked += len;
+    if( it->second.unacked >= stream_window / 4 )
+    {
+        message_ptr w = stream_msg( CTRL_STREAM_WINDOW, id, 4 );
+        put_u32( w->payload() + 5, it->second.unacked );
+        it->second.unacked = 0;
+        queue_write( w, PRIO_HIGH, false );
+    }
+}
+
+bool
+Connection::sink_stream( stream_id id, int fd, boost::uint64_t offset )
+{
+    fd_ptr file( new FileDescriptor( fd ) );
+    std::map< stream_id, in_stream >::iterator it = m_in_streams.find( id );
+    if( it == m_in_streams.end() ) return false;
+    if( !it->second.sink ) ++m_num_sinks;
+    it->second.sink = file;
+    it->second.sink_offset = offset;
+    return true;
+}
+
+bool
+Connection::sink_write( stream_id id, const char * data, size_t len )
+{
+    std::map< stream_id, in_stream >::iterator it = m_in_streams.find( id );
+    in_stream& s = it->second;
+    while( len )
+    {
+        const ssize_t n = pwrite( s.sink->fd(), data, len, s.sink_offset );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 )
+        {
+            F2F_ERROR( "Writing stream " << id << " failed, stopping it" );
+            --m_num_sinks;
+            m_in_streams.erase( it );
+            queue_write( stream_msg( CTRL_STREAM_STOP, id, 0 ), 
+                         PRIO_HIGH, false );
+            m_router->stream_closed( shared_from_this(), id, false );
+            return false;
+        }
+        data += n;
+        len -= n;
+        s.sink_offset += n;
+    }
+    return true;
+}
+
+size_t
+Connection::sink_fragment( size_t off, size_t hlen, size_t len )
+{
+    const char * p = &m_rxbuf[off + hlen];
+    if( len < 5 || p[0] != CTRL_STREAM_DATA ) return 0;
+    const stream_id id = get_u32( p + 1 );
+    std::map< stream_id, in_stream >::iterator it = m_in_streams.find( id );
+    if( it == m_in_streams.end() || !it->second.sink ) return 0;
+    const size_t data = len - 5;
+    const size_t have = std::min( data, m_rxbuf_len - off - hlen - 5 );
+#ifndef __linux__
+    // no splice, so it has to come through the buffer
+    if( have < data ) return 0;
+#endif
+    if( have && !sink_write( id, p + 5, have ) )
+    {
+        // we could read the rest in to skip it, but it's not worth it
+        if( have < data ) fin();
+        return hlen + 5 + have;
+    }
+    stream_consumed( id, have );
+    if( have < data )
+    {
+        m_splice_id = id;
+        m_splice_left = data - have;
+    }
+    return hlen + 5 + have;
+}
+
+void
+Connection::wait_socket( bool write )
+{
+#if BOOST_VERSION >= 106600
+    m_socket.async_wait( write ? boost::asio::ip::tcp::socket::wait_write
+                               : boost::asio::ip::tcp::socket::wait_read,
+                         m_strand.wrap( boost::bind( &Connection::handle_wait,
+                                        shared_from_this(),
+                                        boost::asio::placeholders::error,
+                                        write ) ) );
+#else
+    boost::function<void(const boost::system::error_code&, size_t)> h =
+        m_strand.wrap( boost::bind( &Connection::handle_wait, 
+                                    shared_from_this(),
+                                    boost::asio::placeholders::error, write ) );
+    if( write )
+        m_socket.async_write_some( boost::asio::null_buffers(), h );
+    else
+        m_socket.async_read_some( boost::asio::null_buffers(), h );
+#endif
+}
+
+void
+Connection::handle_wait( const boost::system::error_code& e, bool write )
+{
+    if( m_shuttingdown ) return;
+    if( e )
+    {
+        F2F_WARN( "err " << e.value() << " waiting on socket: " 
+                  << e.message() );
+        fin();
+        return;
+    }
+    if( write ) continue_sendfile();
+    else continue_splice();
+}
+
+void
+Connection::continue_sendfile()
+{
+    if( m_shuttingdown ) return;
+#ifdef __linux__
+    int fd;
+    boost::uint64_t off;
+    size_t len;
+    m_sendfile->file_region( &fd, &off, &len );
+    boost::system::error_code ec;
+    m_socket.native_non_blocking( true, ec );
+    while( m_sendfile_done < len )
+    {
+        off_t o = off + m_sendfile_done;
+        const ssize_t n = ::sendfile( m_socket.native_handle(), fd, &o, 
+                                      len - m_sendfile_done );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n < 0 && errno == EAGAIN )
+        {
+            wait_socket( true );
+            return;
+        }
+        // the frame header is out, there's no way to recover:
+        if( n == 0 )
+        {
+            F2F_ERROR( "sendfile hit the end of the file with " 
+                       << len - m_sendfile_done << " bytes to go, "
+                       << "terminating " << str() );
+            fin();
+            return;
+        }
+        if( n < 0 )
+        {
+            F2F_ERROR( "sendfile failed (" << errno << "), terminating "
+                       << str() );
+            fin();
+            return;
+        }
+        m_sendfile_done += n;
+        m_last_tx = now_us(); // progress, as far as liveness goes
+        boost::mutex::scoped_lock lk(m_mutex);
+        m_write_stats.bytes += n;
+    }
+#endif
+    m_sendfile.reset();
+    // carry on with the writeq:
+    handle_write( boost::system::error_code(), 0 );
+}
+
+void
+Connection::continue_splice()
+{
+    if( m_shuttingdown ) return;
+#ifdef __linux__
+    std::map< stream_id, in_stream >::iterator it = 
+        m_in_streams.find( m_splice_id );
+    if( m_pipe[0] < 0 && pipe2( m_pipe, O_NONBLOCK | O_CLOEXEC ) )
+    {
+        F2F_ERROR( "pipe failed (" << errno << "), terminating " << str() );
+        fin();
+        return;
+    }
+    boost::system::error_code ec;
+    m_socket.native_non_blocking( true, ec );
+    while( m_splice_left )
+    {
+        const ssize_t n = splice( m_socket.native_handle(), 0, m_pipe[1], 0,
+                                  m_splice_left, 
+                                  SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n < 0 && errno == EAGAIN )
+        {
+            wait_socket( false );
+            return;
+        }
+        if( n <= 0 )
+        {
+            F2F_ERROR( "splice from socket failed (" << errno 
+                       << "), terminating " << str() );
+            fin();
+            return;
+        }
+        // a fragment is smaller than the pipe, so this always empties it:
+        size_t left = n;
+        while( left )
+        {
+            loff_t o = it->second.sink_offset;
+            const ssize_t w = splice( m_pipe[0], 0, it->second.sink->fd(), 
+                                      &o, left, SPLICE_F_MOVE );
+            if( w < 0 && errno == EINTR ) continue;
+            if( w <= 0 )
+            {
+                F2F_ERROR( "splice to stream " << m_splice_id 
+                           << " failed (" << errno << "), terminating "
+                           << str() );
+                fin();
+                return;
+            }
+            it->second.sink_offset += w;
+            left -= w;
+        }
+        m_splice_left -= n;
+        m_last_rx = now_us();
+        m_bytes_in.fetch_add( n, boost::memory_order_relaxed );
+        stream_consumed( m_splice_id, n );
+    }
+#endif
+    async_read();
+}
+
+} //ns
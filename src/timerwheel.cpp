@@ -0,0 +1,131 @@
+#include "libf2f/timerwheel.h"
+#include "libf2f/metrics.h"
+
+#include <boost/bind.hpp>
+
+namespace libf2f {
+
+using namespace std;
+
+boost::shared_ptr<TimerWheel>
+TimerWheel::create( boost::asio::io_service& ios, unsigned int tick_ms,
+                    size_t slots )
+{
+    return boost::shared_ptr<TimerWheel>( new TimerWheel( ios, tick_ms, slots ) );
+}
+
+TimerWheel::TimerWheel( boost::asio::io_service& ios, unsigned int tick_ms,
+                        size_t slots )
+    : m_timer( ios ),
+      m_slots( slots ? slots : 1 ),
+      m_tick_ms( tick_ms ? tick_ms : 1 ),
+      m_epoch_us( now_us() ),
+      m_done_tick( 0 ),
+      m_next_id( 1 ),
+      m_ticking( false ),
+      m_stopped( false )
+{
+}
+
+boost::uint64_t
+TimerWheel::current_tick() const
+{
+    return ( now_us() - m_epoch_us ) / ( m_tick_ms * 1000 );
+}
+
+TimerWheel::timer_id
+TimerWheel::add( unsigned int ms, callback cb )
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    if( m_stopped ) return 0;
+    const boost::uint64_t now = current_tick();
+    // nothing pending means nothing was missed, skip the idle ticks:
+    if( m_index.empty() && now > m_done_tick ) m_done_tick = now;
+    boost::uint64_t ticks = ( ms + m_tick_ms - 1 ) / m_tick_ms;
+    if( ticks == 0 ) ticks = 1;
+    const boost::uint64_t due = std::max( now + ticks, m_done_tick + 1 );
+    const size_t s = due % m_slots.size();
+    const timer_id id = m_next_id++;
+    m_slots[s].push_back( entry( id, due, cb ) );
+    m_index[id] = make_pair( s, --m_slots[s].end() );
+    if( !m_ticking ) schedule();
+    return id;
+}
+
+bool
+TimerWheel::cancel( timer_id id )
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    boost::unordered_map< timer_id, pair< size_t, slot::iterator > >::iterator
+        it = m_index.find( id );
+    if( it == m_index.end() ) return false;
+    m_slots[ it->second.first ].erase( it->second.second );
+    m_index.erase( it );
+    // the deadline_timer stops by itself at the next tick if that was
+    // the last one
+    return true;
+}
+
+size_t
+TimerWheel::size()
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    return m_index.size();
+}
+
+void
+TimerWheel::stop()
+{
+    boost::mutex::scoped_lock lk( m_mutex );
+    m_stopped = true;
+    m_index.clear();
+    for( size_t i = 0; i < m_slots.size(); ++i ) m_slots[i].clear();
+    boost::system::error_code ec;
+    m_timer.cancel( ec );
+}
+
+void
+TimerWheel::schedule()
+{
+    m_ticking = true;
+    m_timer.expires_from_now( boost::posix_time::milliseconds( m_tick_ms ) );
+    m_timer.async_wait( boost::bind( &TimerWheel::handle_tick,
+                                     shared_from_this(),
+                                     boost::asio::placeholders::error ) );
+}
+
+void
+TimerWheel::handle_tick( const boost::system::error_code& e )
+{
+    vector< callback > fired;
+    {
+        boost::mutex::scoped_lock lk( m_mutex );
+        m_ticking = false;
+        if( e || m_stopped ) return;
+        const boost::uint64_t now = current_tick();
+        // run every slot since the last tick, if we fell behind by a
+        // revolution or more that's each slot once:
+        boost::uint64_t t = m_done_tick + 1;
+        if( now >= t + m_slots.size() ) t = now - m_slots.size() + 1;
+        for( ; t <= now; ++t )
+        {
+            slot& sl = m_slots[ t % m_slots.size() ];
+            for( slot::iterator it = sl.begin(); it != sl.end(); )
+            {
+                if( it->due > now )
+                {
+                    ++it;
+                    continue;
+                }
+                fired.push_back( it->cb );
+                m_index.erase( it->id );
+                it = sl.erase( it );
+            }
+        }
+        if( now > m_done_tick ) m_done_tick = now;
+        if( !m_index.empty() ) schedule();
+    }
+    for( size_t i = 0; i < fired.size(); ++i ) fired[i]();
+}
+
+} //ns
@@ -0,0 +1,178 @@
+#include "libf2f/wire.h"
+
+namespace libf2f {
+
+using namespace std;
+
+namespace {
+
+/// the '-' positions of a canonical UUID
+inline bool
+is_dash_pos( size_t i )
+{
+    return i == 8 || i == 13 || i == 18 || i == 23;
+}
+
+int
+hex_val( char c, int * upper )
+{
+    if( c >= '0' && c <= '9' ) return c - '0';
+    if( c >= 'a' && c <= 'f' ) { *upper |= 1; return c - 'a' + 10; }
+    if( c >= 'A' && c <= 'F' ) { *upper |= 2; return c - 'A' + 10; }
+    return -1;
+}
+
+/// packs a canonical UUID to 16 bytes, returns false if guid isn't one.
+/// *upper is set if its letters are upper case.
+bool
+pack_uuid( const char * guid, unsigned char * out, bool * upper )
+{
+    int cases = 0;
+    size_t n = 0;
+    for( size_t i = 0; i < 36; ++i )
+    {
+        if( is_dash_pos( i ) )
+        {
+            if( guid[i] != '-' ) return false;
+            continue;
+        }
+        int v = hex_val( guid[i], &cases );
+        if( v < 0 ) return false;
+        if( n & 1 ) out[n/2] |= v;
+        else out[n/2] = v << 4;
+        ++n;
+    }
+    if( cases == 3 ) return false; // mixed case won't round trip
+    *upper = ( cases == 2 );
+    return true;
+}
+
+void
+unpack_uuid( const unsigned char * in, bool upper, char * guid )
+{
+    const char * digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    size_t n = 0;
+    for( size_t i = 0; i < 36; ++i )
+    {
+        if( is_dash_pos( i ) )
+        {
+            guid[i] = '-';
+            continue;
+        }
+        const unsigned char b = in[n/2];
+        guid[i] = digits[ (n & 1) ? (b & 0x0f) : (b >> 4) ];
+        ++n;
+    }
+}
+
+size_t
+put_varint( unsigned char * p, boost::uint32_t v )
+{
+    size_t n = 0;
+    do
+    {
+        unsigned char b = v & 0x7f;
+        v >>= 7;
+        if( v ) b |= 0x80;
+        p[n++] = b;
+    } while( v );
+    return n;
+}
+
+/// returns bytes used, 0 if incomplete, -1 if too long
+int
+get_varint( const unsigned char * p, size_t len, boost::uint32_t * v )
+{
+    *v = 0;
+    for( size_t i = 0; i < 5; ++i )
+    {
+        if( i == len ) return 0;
+        *v |= boost::uint32_t( p[i] & 0x7f ) << (7*i);
+        if( !( p[i] & 0x80 ) ) return i + 1;
+    }
+    return -1;
+}
+
+} // anon ns
+
+size_t
+encode_header_v2( const message_header& h, char * out, boost::uint32_t zlen )
+{
+    unsigned char * p = (unsigned char *)out;
+    unsigned char flags = 0;
+    size_t off = 2;
+    p[1] = h.type;
+    if( h.ttl != 1 || h.hops != 0 )
+    {
+        flags |= V2_TTL_HOPS;
+        p[off++] = h.ttl;
+        p[off++] = h.hops;
+    }
+    bool upper;
+    if( pack_uuid( h.guid, p + off, &upper ) )
+    {
+        flags |= V2_GUID_UUID;
+        if( upper ) flags |= V2_GUID_UPPER;
+        off += 16;
+    }
+    else
+    {
+        memcpy( p + off, h.guid, 36 );
+        off += 36;
+    }
+    if( zlen )
+    {
+        flags |= V2_COMPRESSED;
+        off += put_varint( p + off, zlen );
+    }
+    off += put_varint( p + off, ntohl( h.length ) );
+    p[0] = flags;
+    return off;
+}
+
+int
+decode_header_v2( const char * data, size_t len, message_header& h,
+                  boost::uint32_t * zlen )
+{
+    const unsigned char * p = (const unsigned char *)data;
+    if( len < 2 ) return 0;
+    const unsigned char flags = p[0];
+    if( flags & ~( V2_GUID_UUID | V2_GUID_UPPER | V2_TTL_HOPS | 
+                   V2_COMPRESSED ) ) 
+        return -1;
+    h.type = p[1];
+    size_t off = 2;
+    if( flags & V2_TTL_HOPS )
+    {
+        if( len < off + 2 ) return 0;
+        h.ttl = p[off++];
+        h.hops = p[off++];
+    }
+    else
+    {
+        h.ttl = 1;
+        h.hops = 0;
+    }
+    const size_t glen = ( flags & V2_GUID_UUID ) ? 16 : 36;
+    if( len < off + glen ) return 0;
+    if( flags & V2_GUID_UUID )
+        unpack_uuid( p + off, flags & V2_GUID_UPPER, h.guid );
+    else
+        memcpy( h.guid, p + off, 36 );
+    off += glen;
+    int n;
+    *zlen = 0;
+    if( flags & V2_COMPRESSED )
+    {
+        if( ( n = get_varint( p + off, len - off, zlen ) ) <= 0 ) return n;
+        if( !*zlen ) return -1;
+        off += n;
+    }
+    boost::uint32_t plen;
+    if( ( n = get_varint( p + off, len - off, &plen ) ) <= 0 ) return n;
+    off += n;
+    h.length = htonl( plen );
+    return off;
+}
+
+} //ns